@@ -13,12 +13,16 @@
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/percpu.h>
 
 #include "zcomp.h"
 #include "zcomp_lzo.h"
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 #include "zcomp_lz4.h"
 #endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+#include "zcomp_lz4hc.h"
+#endif
 
 /*
  * single zcomp_strm backend
@@ -47,6 +51,9 @@ static struct zcomp_backend *backends[] = {
 	&zcomp_lzo,
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 	&zcomp_lz4,
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	&zcomp_lz4hc,
 #endif
 	NULL
 };
@@ -80,6 +87,7 @@ static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
 	if (!zstrm)
 		return NULL;
 
+	zstrm->percpu = false;
 	zstrm->private = comp->backend->create();
 	/*
 	 * allocate 2 pages. 1 for compressed data, plus 1 extra for the
@@ -267,6 +275,56 @@ static int zcomp_strm_single_create(struct zcomp *comp)
 	return 0;
 }
 
+/*
+ * per-CPU zcomp_strm streams: every possible CPU owns one stream, which
+ * is used with preemption disabled, so neither a list nor a lock is
+ * needed to hand it out.
+ */
+static struct zcomp_strm *zcomp_strm_percpu_find(struct zcomp *comp)
+{
+	return *get_cpu_ptr(comp->pcpu_strm);
+}
+
+static void zcomp_strm_percpu_release(struct zcomp *comp)
+{
+	put_cpu_ptr(comp->pcpu_strm);
+}
+
+static void zcomp_strm_percpu_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		zstrm = *per_cpu_ptr(comp->pcpu_strm, cpu);
+		if (zstrm)
+			zcomp_strm_free(comp, zstrm);
+	}
+	free_percpu(comp->pcpu_strm);
+	comp->pcpu_strm = NULL;
+}
+
+static int zcomp_strm_percpu_create(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+	int cpu;
+
+	comp->pcpu_strm = alloc_percpu(struct zcomp_strm *);
+	if (!comp->pcpu_strm)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		zstrm = zcomp_strm_alloc(comp);
+		if (!zstrm) {
+			zcomp_strm_percpu_destroy(comp);
+			return -ENOMEM;
+		}
+		zstrm->percpu = true;
+		*per_cpu_ptr(comp->pcpu_strm, cpu) = zstrm;
+	}
+	return 0;
+}
+
 /* show available compressors */
 ssize_t zcomp_available_show(const char *comp, char *buf)
 {
@@ -291,14 +349,29 @@ bool zcomp_set_max_streams(struct zcomp *comp, int num_strm)
 	return comp->set_max_streams(comp, num_strm);
 }
 
+/*
+ * Returns the per-CPU stream with preemption disabled if @comp has them,
+ * otherwise falls back to zcomp_strm_find_sleepable().
+ */
 struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	if (comp->pcpu_strm)
+		return zcomp_strm_percpu_find(comp);
+	return comp->strm_find(comp);
+}
+
+/* get a stream which the caller may hold across sleeping allocations */
+struct zcomp_strm *zcomp_strm_find_sleepable(struct zcomp *comp)
 {
 	return comp->strm_find(comp);
 }
 
 void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
 {
-	comp->strm_release(comp, zstrm);
+	if (zstrm->percpu)
+		zcomp_strm_percpu_release(comp);
+	else
+		comp->strm_release(comp, zstrm);
 }
 
 int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
@@ -316,6 +389,8 @@ int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
 
 void zcomp_destroy(struct zcomp *comp)
 {
+	if (comp->pcpu_strm)
+		zcomp_strm_percpu_destroy(comp);
 	comp->destroy(comp);
 	kfree(comp);
 }
@@ -326,9 +401,13 @@ void zcomp_destroy(struct zcomp *comp)
  * backend pointer or ERR_PTR if things went bad. ERR_PTR(-EINVAL)
  * if requested algorithm is not supported, ERR_PTR(-ENOMEM) in
  * case of allocation error, or any other error potentially
- * returned by functions zcomp_strm_{multi,single}_create.
+ * returned by functions zcomp_strm_{multi,single,percpu}_create.
+ *
+ * With @percpu set, zcomp_strm_find() hands out per-CPU streams and the
+ * single/multi streams limited by @max_strm only serve callers of
+ * zcomp_strm_find_sleepable().
  */
-struct zcomp *zcomp_create(const char *compress, int max_strm)
+struct zcomp *zcomp_create(const char *compress, int max_strm, bool percpu)
 {
 	struct zcomp *comp;
 	struct zcomp_backend *backend;
@@ -351,5 +430,14 @@ struct zcomp *zcomp_create(const char *compress, int max_strm)
 		kfree(comp);
 		return ERR_PTR(error);
 	}
+
+	if (percpu) {
+		error = zcomp_strm_percpu_create(comp);
+		if (error) {
+			comp->destroy(comp);
+			kfree(comp);
+			return ERR_PTR(error);
+		}
+	}
 	return comp;
 }
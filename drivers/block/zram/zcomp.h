@@ -23,6 +23,8 @@ struct zcomp_strm {
 	void *private;
 	/* used in multi stream backend, protected by backend strm_lock */
 	struct list_head list;
+	/* per-CPU stream, held with preemption disabled */
+	bool percpu;
 };
 
 /* static compression backend */
@@ -42,6 +44,8 @@ struct zcomp_backend {
 /* dynamic per-device compression frontend */
 struct zcomp {
 	void *stream;
+	/* per-CPU streams, NULL unless the per-CPU mode was requested */
+	struct zcomp_strm * __percpu *pcpu_strm;
 	struct zcomp_backend *backend;
 
 	struct zcomp_strm *(*strm_find)(struct zcomp *comp);
@@ -52,12 +56,22 @@ struct zcomp {
 
 ssize_t zcomp_available_show(const char *comp, char *buf);
 
-struct zcomp *zcomp_create(const char *comp, int max_strm);
+struct zcomp *zcomp_create(const char *comp, int max_strm, bool percpu);
 void zcomp_destroy(struct zcomp *comp);
 
 struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+struct zcomp_strm *zcomp_strm_find_sleepable(struct zcomp *comp);
 void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
 
+/*
+ * True if @zstrm was handed out with preemption disabled, in which
+ * case the holder must not sleep until zcomp_strm_release().
+ */
+static inline bool zcomp_strm_atomic(struct zcomp_strm *zstrm)
+{
+	return zstrm->percpu;
+}
+
 int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
 		const unsigned char *src, size_t *dst_len);
 
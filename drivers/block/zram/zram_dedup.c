@@ -0,0 +1,225 @@
+/*
+ * Same content page deduplication for zram
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/highmem.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket for every 2^ZRAM_HASH_SHIFT pages of disksize */
+#define ZRAM_HASH_SHIFT		4
+#define ZRAM_HASH_SIZE_MIN	(1 << 10)
+#define ZRAM_HASH_SIZE_MAX	(1 << 20)
+
+u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash2((const u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct zram_hash *zram_dedup_hash(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum % zram->hash_size];
+}
+
+struct zram_entry *zram_dedup_alloc(struct zram *zram, unsigned long handle,
+				    unsigned int len, u32 checksum)
+{
+	struct zram_entry *entry;
+
+	entry = kzalloc(sizeof(*entry), GFP_NOIO | __GFP_NOWARN);
+	if (!entry)
+		return NULL;
+
+	RB_CLEAR_NODE(&entry->rb_node);
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	atomic64_add(sizeof(*entry), &zram->stats.meta_data_size);
+
+	return entry;
+}
+
+/*
+ * Make @entry visible to zram_dedup_find(). The object behind
+ * entry->handle must already hold the compressed data.
+ */
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, entry->checksum);
+	struct rb_node **rb_node, *parent = NULL;
+	struct zram_entry *cur;
+
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		cur = rb_entry(parent, struct zram_entry, rb_node);
+		if (entry->checksum < cur->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+
+	rb_link_node(&entry->rb_node, parent, rb_node);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+}
+
+/*
+ * Drop a reference to @entry. Returns true if this was the last one and
+ * the compressed object has been freed, false if it is still shared.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, entry->checksum);
+	unsigned long refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount && !RB_EMPTY_NODE(&entry->rb_node)) {
+		rb_erase(&entry->rb_node, &hash->rb_root);
+		RB_CLEAR_NODE(&entry->rb_node);
+	}
+	spin_unlock(&hash->lock);
+
+	if (refcount) {
+		atomic64_sub(entry->len, &zram->stats.dup_data_size);
+		return false;
+	}
+
+	zs_free(zram->meta->mem_pool, entry->handle);
+	atomic64_sub(sizeof(*entry), &zram->stats.meta_data_size);
+	kfree(entry);
+
+	return true;
+}
+
+static bool zram_dedup_match(struct zram *zram, struct zcomp_strm *zstrm,
+			     struct zram_entry *entry, unsigned char *mem)
+{
+	struct zs_pool *pool = zram->meta->mem_pool;
+	unsigned char *cmem;
+	bool match = false;
+
+	cmem = zs_map_object(pool, entry->handle, ZS_MM_RO);
+	if (entry->len == PAGE_SIZE)
+		match = !memcmp(mem, cmem, PAGE_SIZE);
+	else if (!zcomp_decompress(zram->comp, cmem, entry->len,
+				   zstrm->buffer))
+		match = !memcmp(mem, zstrm->buffer, PAGE_SIZE);
+	zs_unmap_object(pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look for a stored page identical to @mem. On success a reference to
+ * the matching entry is returned and the caller owns it. zstrm->buffer
+ * is clobbered, so compress only after this returns.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *zstrm,
+				   unsigned char *mem, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram, checksum);
+	struct zram_entry *entry = NULL, *prev = NULL;
+	struct rb_node *rb_node;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+
+	/* back up to the first entry with this checksum */
+	while (rb_node) {
+		struct rb_node *prev_node = rb_prev(rb_node);
+
+		if (!prev_node || rb_entry(prev_node, struct zram_entry,
+					   rb_node)->checksum != checksum)
+			break;
+		rb_node = prev_node;
+	}
+
+	/*
+	 * Walk every entry with a matching checksum. The reference taken
+	 * keeps the entry in the tree while the lock is dropped for the
+	 * content comparison, so rb_next() on it stays valid.
+	 */
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+
+		entry->refcount++;
+		atomic64_add(entry->len, &zram->stats.dup_data_size);
+		spin_unlock(&hash->lock);
+
+		if (prev)
+			zram_dedup_put(zram, prev);
+
+		if (zram_dedup_match(zram, zstrm, entry, mem))
+			return entry;
+
+		prev = entry;
+		spin_lock(&hash->lock);
+		rb_node = rb_next(rb_node);
+	}
+	spin_unlock(&hash->lock);
+
+	if (prev)
+		zram_dedup_put(zram, prev);
+
+	return NULL;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	int i;
+	struct zram_hash *hash;
+
+	if (!zram_dedup_enabled(zram))
+		return 0;
+
+	zram->hash_size = num_pages >> ZRAM_HASH_SHIFT;
+	zram->hash_size = min_t(size_t, ZRAM_HASH_SIZE_MAX, zram->hash_size);
+	zram->hash_size = max_t(size_t, ZRAM_HASH_SIZE_MIN, zram->hash_size);
+	zram->hash = vzalloc(zram->hash_size * sizeof(struct zram_hash));
+	if (!zram->hash) {
+		pr_err("Error allocating zram entry hash\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < zram->hash_size; i++) {
+		hash = &zram->hash[i];
+		spin_lock_init(&hash->lock);
+		hash->rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
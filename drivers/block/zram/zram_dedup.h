@@ -0,0 +1,58 @@
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+struct zram;
+struct zram_entry;
+struct zcomp_strm;
+
+#ifdef CONFIG_ZRAM_DEDUP
+
+u32 zram_dedup_checksum(unsigned char *mem);
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *zstrm,
+				   unsigned char *mem, u32 checksum);
+struct zram_entry *zram_dedup_alloc(struct zram *zram, unsigned long handle,
+				    unsigned int len, u32 checksum);
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry);
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+static inline bool zram_dedup_enabled(struct zram *zram)
+{
+	return zram->use_dedup;
+}
+#else
+
+static inline u32 zram_dedup_checksum(unsigned char *mem) { return 0; }
+static inline struct zram_entry *zram_dedup_find(struct zram *zram,
+		struct zcomp_strm *zstrm, unsigned char *mem, u32 checksum)
+{
+	return NULL;
+}
+static inline struct zram_entry *zram_dedup_alloc(struct zram *zram,
+		unsigned long handle, unsigned int len, u32 checksum)
+{
+	return NULL;
+}
+static inline void zram_dedup_insert(struct zram *zram,
+		struct zram_entry *entry) { }
+static inline bool zram_dedup_put(struct zram *zram,
+		struct zram_entry *entry)
+{
+	return true;
+}
+
+static inline int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	return 0;
+}
+static inline void zram_dedup_fini(struct zram *zram) { }
+
+static inline bool zram_dedup_enabled(struct zram *zram)
+{
+	return false;
+}
+#endif
+
+#endif /* _ZRAM_DEDUP_H_ */
@@ -34,12 +34,17 @@
 #include <linux/vmalloc.h>
 #include <linux/ratelimit.h>
 #include <linux/err.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
 
 #include "zram_drv.h"
 
 /* Globals */
 static int zram_major;
 static struct zram *zram_devices;
+/* runs the per-CPU chunks of asynchronous write bios */
+static struct workqueue_struct *zram_wq;
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 static const char *default_compressor = "lz4";
 #else
@@ -121,6 +126,107 @@ static ssize_t mem_used_total_show(struct device *dev,
 	return scnprintf(buf, PAGE_SIZE, "%llu\n", val << PAGE_SHIFT);
 }
 
+static ssize_t mem_limit_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->limit_pages;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", val << PAGE_SHIFT);
+}
+
+static ssize_t mem_limit_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	u64 limit;
+	char *tmp;
+	struct zram *zram = dev_to_zram(dev);
+
+	limit = memparse(buf, &tmp);
+	if (buf == tmp) /* no chars parsed, invalid input */
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	zram->limit_pages = PAGE_ALIGN(limit) >> PAGE_SHIFT;
+	up_write(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t mem_used_max_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 val = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		val = atomic_long_read(&zram->stats.max_used_pages);
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", val << PAGE_SHIFT);
+}
+
+static ssize_t mem_used_max_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int err;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	/* only resetting to the current usage is supported */
+	err = kstrtoul(buf, 10, &val);
+	if (err || val != 0)
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		atomic_long_set(&zram->stats.max_used_pages,
+				zs_get_total_pages(zram->meta->mem_pool));
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	zs_compact(meta->mem_pool);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zs_pool_stats pool_stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	memset(&pool_stats, 0, sizeof(pool_stats));
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		zs_pool_stats(zram->meta->mem_pool, &pool_stats);
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", pool_stats.pages_compacted);
+}
+
 static ssize_t max_comp_streams_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -163,6 +269,61 @@ out:
 	return ret;
 }
 
+static ssize_t percpu_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->percpu_comp_streams;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+static ssize_t percpu_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change stream mode for initialized device\n");
+		return -EBUSY;
+	}
+	zram->percpu_comp_streams = val;
+	up_write(&zram->init_lock);
+	return len;
+}
+
+static ssize_t async_write_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			(int)ACCESS_ONCE(zram->async_write));
+}
+
+static ssize_t async_write_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	zram->async_write = val;
+	return len;
+}
+
 static ssize_t comp_algorithm_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -191,6 +352,71 @@ static ssize_t comp_algorithm_store(struct device *dev,
 	return len;
 }
 
+#ifdef CONFIG_ZRAM_DEDUP
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->use_dedup;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change dedup usage for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = val;
+	up_write(&zram->init_lock);
+	return len;
+}
+#endif
+
+#ifdef CONFIG_ZRAM_MULTI_COMP
+static ssize_t recomp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	sz = zcomp_available_show(zram->recomp_algorithm, buf);
+	up_read(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t recomp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->recomp_algorithm, buf, sizeof(zram->recomp_algorithm));
+	up_write(&zram->init_lock);
+	return len;
+}
+#endif
+
 /* flag operations needs meta->tb_lock */
 static int zram_test_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
@@ -223,6 +449,29 @@ static void zram_set_obj_size(struct zram_meta *meta,
 	meta->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
+/*
+ * zsmalloc handle of a compressed slot, looking through its dedup entry.
+ * Needs the slot's ZRAM_ACCESS lock.
+ */
+static unsigned long zram_get_handle(struct zram *zram, u32 index)
+{
+	unsigned long handle = zram->meta->table[index].handle;
+
+	if (zram_dedup_enabled(zram))
+		return ((struct zram_entry *)handle)->handle;
+	return handle;
+}
+
+/* Backend the compressed slot @index was stored with. */
+static struct zcomp *zram_slot_comp(struct zram *zram, u32 index)
+{
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	if (zram_test_flag(zram->meta, index, ZRAM_RECOMP))
+		return zram->recomp;
+#endif
+	return zram->comp;
+}
+
 static inline int is_partial_io(struct bio_vec *bvec)
 {
 	return bvec->bv_len != PAGE_SIZE;
@@ -252,6 +501,142 @@ static inline int valid_io_request(struct zram *zram, struct bio *bio)
 	return 1;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	set_blocksize(zram->bdev, zram->old_block_size);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	kfree(zram->backing_dev_name);
+	zram->backing_dev_name = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	if (!zram->bdev)
+		ret = scnprintf(buf, PAGE_SIZE, "none\n");
+	else
+		ret = scnprintf(buf, PAGE_SIZE, "%s\n",
+				zram->backing_dev_name);
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char *file_name;
+	size_t sz;
+	struct block_device *bdev;
+	unsigned long nr_pages, *bitmap = NULL;
+	unsigned int old_block_size;
+	struct zram *zram = dev_to_zram(dev);
+	int err;
+
+	file_name = kstrndup(buf, PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
+
+	/* ignore trailing newline */
+	sz = strlen(file_name);
+	if (sz > 0 && file_name[sz - 1] == '\n')
+		file_name[sz - 1] = 0x00;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Can't setup backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	bdev = blkdev_get_by_path(file_name,
+			FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (IS_ERR(bdev)) {
+		err = PTR_ERR(bdev);
+		goto out;
+	}
+
+	/* block 0 is never handed out, see alloc_block_bdev() */
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		err = -EINVAL;
+		goto out_put;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out_put;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out_put;
+
+	reset_bdev(zram);
+
+	zram->bdev = bdev;
+	zram->old_block_size = old_block_size;
+	zram->backing_dev_name = file_name;
+	zram->nr_pages = nr_pages;
+	zram->bitmap = bitmap;
+	up_write(&zram->init_lock);
+
+	pr_info("setup backing device %s\n", file_name);
+	return len;
+
+out_put:
+	vfree(bitmap);
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out:
+	up_write(&zram->init_lock);
+	kfree(file_name);
+	return err;
+}
+
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+retry:
+	/* skip 0 bit so that a handle of 0 never means a backing block */
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx == zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	int was_set;
+
+	was_set = test_and_clear_bit(blk_idx, zram->bitmap);
+	WARN_ON_ONCE(!was_set);
+	atomic64_dec(&zram->stats.bd_count);
+}
+#else
+static inline void reset_bdev(struct zram *zram) {}
+static inline void free_block_bdev(struct zram *zram,
+				   unsigned long blk_idx) {}
+#endif
+
 static void zram_meta_free(struct zram_meta *meta)
 {
 	zs_destroy_pool(meta->mem_pool);
@@ -273,12 +658,13 @@ static struct zram_meta *zram_meta_alloc(u64 disksize)
 		goto free_meta;
 	}
 
-	meta->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM |
-					__GFP_NOWARN);
+	meta->mem_pool = zs_create_pool();
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		goto free_table;
 	}
+	/* the lowmemorykiller weighs swapped pages by this */
+	zs_pool_set_stat(meta->mem_pool, NR_ZRAM_PAGES);
 
 	return meta;
 
@@ -291,6 +677,21 @@ out:
 	return meta;
 }
 
+static inline void update_used_max(struct zram *zram,
+					const unsigned long pages)
+{
+	unsigned long old_max, cur_max;
+
+	old_max = atomic_long_read(&zram->stats.max_used_pages);
+
+	do {
+		cur_max = old_max;
+		if (pages > cur_max)
+			old_max = atomic_long_cmpxchg(
+				&zram->stats.max_used_pages, cur_max, pages);
+	} while (old_max != cur_max);
+}
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -298,31 +699,57 @@ static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
-static int page_zero_filled(void *ptr)
+static void zram_fill_page(void *ptr, unsigned long len,
+			   unsigned long value)
 {
-	unsigned int pos;
+	unsigned long *page = ptr;
+	unsigned long pos;
+
+	WARN_ON_ONCE(!IS_ALIGNED(len, sizeof(unsigned long)));
+
+	if (likely(value == 0)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
+/*
+ * Check whether the page is filled with a single repeated word and if so
+ * return that word in @element.
+ */
+static bool page_same_filled(void *ptr, unsigned long *element)
+{
+	unsigned int pos, last_pos = PAGE_SIZE / sizeof(unsigned long) - 1;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
+
+	/* cheap early exit for the common case of a non-uniform page */
+	if (val != page[last_pos])
+		return false;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
-			return 0;
+	for (pos = 1; pos < last_pos; pos++) {
+		if (val != page[pos])
+			return false;
 	}
 
-	return 1;
+	*element = val;
+
+	return true;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	if (is_partial_io(bvec))
-		memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	else
-		clear_page(user_mem);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -339,29 +766,168 @@ static void zram_free_page(struct zram *zram, size_t index)
 	struct zram_meta *meta = zram->meta;
 	unsigned long handle = meta->table[index].handle;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
-			zram_clear_flag(meta, index, ZRAM_ZERO);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_RECOMP);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+
+	if (zram_test_flag(meta, index, ZRAM_HUGE)) {
+		zram_clear_flag(meta, index, ZRAM_HUGE);
+		atomic64_dec(&zram->stats.huge_pages);
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages, the
+	 * handle holds the fill value. Simply clear same page flag.
+	 */
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		zram_clear_flag(meta, index, ZRAM_SAME);
+		atomic64_dec(&zram->stats.same_pages);
+		if (!handle)
 			atomic64_dec(&zram->stats.zero_pages);
-		}
+		meta->table[index].handle = 0;
+		return;
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_block_bdev(zram, handle);
+		atomic64_dec(&zram->stats.pages_stored);
+		meta->table[index].handle = 0;
 		return;
 	}
 
-	zs_free(meta->mem_pool, handle);
+	if (unlikely(!handle))
+		return;
 
-	atomic64_sub(zram_get_obj_size(meta, index),
-			&zram->stats.compr_data_size);
+	if (zram_dedup_enabled(zram)) {
+		/* other slots may still share the compressed object */
+		if (zram_dedup_put(zram, (struct zram_entry *)handle))
+			atomic64_sub(zram_get_obj_size(meta, index),
+					&zram->stats.compr_data_size);
+	} else {
+		zs_free(meta->mem_pool, handle);
+		atomic64_sub(zram_get_obj_size(meta, index),
+				&zram->stats.compr_data_size);
+	}
 	atomic64_dec(&zram->stats.pages_stored);
 
 	meta->table[index].handle = 0;
 	zram_set_obj_size(meta, index, 0);
 }
 
-static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_bdev_read_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronously read block @entry of the backing device into @page.
+ * Caller must not hold the slot's ZRAM_ACCESS lock.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long entry)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret = 0;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = entry * (PAGE_SIZE >> SECTOR_SHIFT);
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_bdev_read_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(READ_SYNC, bio);
+	wait_for_completion(&done);
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ret = -EIO;
+	bio_put(bio);
+
+	atomic64_inc(&zram->stats.bd_reads);
+	return ret;
+}
+
+static int read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+			  unsigned long entry, int offset)
+{
+	struct page *page;
+	void *src, *dst;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_read_from_bdev(zram, bvec->bv_page, entry);
+		if (!ret)
+			flush_dcache_page(bvec->bv_page);
+		return ret;
+	}
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_read_from_bdev(zram, page, entry);
+	if (!ret) {
+		src = kmap_atomic(page);
+		dst = kmap_atomic(bvec->bv_page);
+		memcpy(dst + bvec->bv_offset, src + offset, bvec->bv_len);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+		flush_dcache_page(bvec->bv_page);
+	}
+	__free_page(page);
+	return ret;
+}
+
+static int read_from_bdev_to_buf(struct zram *zram, char *mem,
+				 unsigned long entry)
+{
+	struct page *page;
+	void *src;
+	int ret;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_read_from_bdev(zram, page, entry);
+	if (!ret) {
+		src = kmap_atomic(page);
+		copy_page(mem, src);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+	return ret;
+}
+#else
+static inline int read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+				 unsigned long entry, int offset)
+{
+	return -EIO;
+}
+
+static inline int read_from_bdev_to_buf(struct zram *zram, char *mem,
+					unsigned long entry)
+{
+	return -EIO;
+}
+#endif
+
+/*
+ * Reading a written back page from the backing device sleeps, so a caller
+ * that cannot sleep gets -EAGAIN for one and has to retry without @atomic.
+ */
+static int __zram_decompress_page(struct zram *zram, char *mem, u32 index,
+				  bool atomic)
 {
 	int ret = 0;
 	unsigned char *cmem;
@@ -373,17 +939,27 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	handle = meta->table[index].handle;
 	size = zram_get_obj_size(meta, index);
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
+	if (!handle || zram_test_flag(meta, index, ZRAM_SAME)) {
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		clear_page(mem);
+		zram_fill_page(mem, PAGE_SIZE, handle);
 		return 0;
 	}
 
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		if (atomic)
+			return -EAGAIN;
+		return read_from_bdev_to_buf(zram, mem, handle);
+	}
+
+	handle = zram_get_handle(zram, index);
+
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
 	if (size == PAGE_SIZE)
 		copy_page(mem, cmem);
 	else
-		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+		ret = zcomp_decompress(zram_slot_comp(zram, index), cmem,
+				       size, mem);
 	zs_unmap_object(meta->mem_pool, handle);
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
@@ -396,6 +972,11 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+{
+	return __zram_decompress_page(zram, mem, index, false);
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
@@ -405,12 +986,22 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	struct zram_meta *meta = zram->meta;
 	page = bvec->bv_page;
 
+again:
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
 	if (unlikely(!meta->table[index].handle) ||
-			zram_test_flag(meta, index, ZRAM_ZERO)) {
+			zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].handle;
+
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		handle_same_page(bvec, element);
+		return 0;
+	}
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long entry = meta->table[index].handle;
+
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		handle_zero_page(bvec);
-		return 0;
+		return read_from_bdev(zram, bvec, entry, offset);
 	}
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
@@ -428,7 +1019,15 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		goto out_cleanup;
 	}
 
-	ret = zram_decompress_page(zram, uncmem, index);
+	ret = __zram_decompress_page(zram, uncmem, index, true);
+	if (ret == -EAGAIN) {
+		/* written back since we looked, read it from the bdev */
+		kunmap_atomic(user_mem);
+		if (is_partial_io(bvec))
+			kfree(uncmem);
+		uncmem = NULL;
+		goto again;
+	}
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret))
 		goto out_cleanup;
@@ -457,7 +1056,12 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	struct zram_meta *meta = zram->meta;
 	static unsigned long zram_rs_time;
 	struct zcomp_strm *zstrm;
+	struct zram_entry *entry;
+	unsigned long element;
+	unsigned long alloced_pages;
+	u32 checksum = 0;
 	bool locked = false;
+	bool sleepable = false;
 
 	page = bvec->bv_page;
 	if (is_partial_io(bvec)) {
@@ -475,7 +1079,11 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 	}
 
-	zstrm = zcomp_strm_find(zram->comp);
+compress_again:
+	if (sleepable)
+		zstrm = zcomp_strm_find_sleepable(zram->comp);
+	else
+		zstrm = zcomp_strm_find(zram->comp);
 	locked = true;
 	user_mem = kmap_atomic(page);
 
@@ -488,19 +1096,41 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = user_mem;
 	}
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem);
 		/* Free memory associated with this sector now. */
 		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 		zram_free_page(zram, index);
-		zram_set_flag(meta, index, ZRAM_ZERO);
+		zram_set_flag(meta, index, ZRAM_SAME);
+		meta->table[index].handle = element;
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
-		atomic64_inc(&zram->stats.zero_pages);
+		atomic64_inc(&zram->stats.same_pages);
+		if (!element)
+			atomic64_inc(&zram->stats.zero_pages);
 		ret = 0;
 		goto out;
 	}
 
+	if (zram_dedup_enabled(zram)) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			if (!is_partial_io(bvec)) {
+				kunmap_atomic(user_mem);
+				uncmem = NULL;
+			}
+			zcomp_strm_release(zram->comp, zstrm);
+			locked = false;
+			handle = (unsigned long)entry;
+			clen = entry->len;
+			/* keep mem_used_max current on every store */
+			update_used_max(zram,
+					zs_get_total_pages(meta->mem_pool));
+			goto found_dup;
+		}
+	}
+
 	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 	if (!is_partial_io(bvec)) {
 		kunmap_atomic(user_mem);
@@ -519,7 +1149,24 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			src = uncmem;
 	}
 
-	handle = zs_malloc(meta->mem_pool, clen);
+	/*
+	 * A per-CPU stream is held with preemption disabled, so only try
+	 * an allocation that cannot sleep. If that fails, drop the stream
+	 * and redo the compression with one we may sleep on.
+	 */
+	if (zcomp_strm_atomic(zstrm))
+		handle = zs_malloc(meta->mem_pool, clen,
+				   GFP_NOWAIT | __GFP_HIGHMEM | __GFP_NOWARN);
+	else
+		handle = zs_malloc(meta->mem_pool, clen,
+				   GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!handle && zcomp_strm_atomic(zstrm)) {
+		zcomp_strm_release(zram->comp, zstrm);
+		locked = false;
+		atomic64_inc(&zram->stats.writestall);
+		sleepable = true;
+		goto compress_again;
+	}
 	if (!handle) {
 		if (printk_timed_ratelimit(&zram_rs_time,
 					   ALLOC_ERROR_LOG_RATE_MS))
@@ -528,6 +1175,16 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = -ENOMEM;
 		goto out;
 	}
+
+	alloced_pages = zs_get_total_pages(meta->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(meta->mem_pool, handle);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	update_used_max(zram, alloced_pages);
+
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
 
 	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
@@ -542,6 +1199,19 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	locked = false;
 	zs_unmap_object(meta->mem_pool, handle);
 
+	if (zram_dedup_enabled(zram)) {
+		entry = zram_dedup_alloc(zram, handle, clen, checksum);
+		if (!entry) {
+			zs_free(meta->mem_pool, handle);
+			ret = -ENOMEM;
+			goto out;
+		}
+		zram_dedup_insert(zram, entry);
+		handle = (unsigned long)entry;
+	}
+	atomic64_add(clen, &zram->stats.compr_data_size);
+
+found_dup:
 	/*
 	 * Free memory associated with this sector
 	 * before overwriting unused sectors.
@@ -551,10 +1221,13 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	meta->table[index].handle = handle;
 	zram_set_obj_size(meta, index, clen);
+	if (clen == PAGE_SIZE) {
+		zram_set_flag(meta, index, ZRAM_HUGE);
+		atomic64_inc(&zram->stats.huge_pages);
+	}
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
 	/* Update stats */
-	atomic64_add(clen, &zram->stats.compr_data_size);
 	atomic64_inc(&zram->stats.pages_stored);
 out:
 	if (locked)
@@ -617,155 +1290,625 @@ static void zram_bio_discard(struct zram *zram, u32 index,
 		index++;
 	}
 
-	while (n >= PAGE_SIZE) {
-		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-		zram_free_page(zram, index);
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		index++;
-		n -= PAGE_SIZE;
+	while (n >= PAGE_SIZE) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_free_page(zram, index);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		index++;
+		n -= PAGE_SIZE;
+	}
+}
+
+static void zram_reset_device(struct zram *zram, bool reset_capacity)
+{
+	size_t index;
+	struct zram_meta *meta;
+
+	down_write(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_write(&zram->init_lock);
+		return;
+	}
+
+	/* workers don't take init_lock, wait for them to finish */
+	wait_event(zram->async_wait, !atomic_read(&zram->async_pending));
+
+	meta = zram->meta;
+	/* Free all pages that are still in this zram device */
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		unsigned long handle = meta->table[index].handle;
+		if (!handle || zram_test_flag(meta, index, ZRAM_WB) ||
+				zram_test_flag(meta, index, ZRAM_SAME))
+			continue;
+
+		if (zram_dedup_enabled(zram))
+			zram_dedup_put(zram, (struct zram_entry *)handle);
+		else
+			zs_free(meta->mem_pool, handle);
+	}
+	zram_dedup_fini(zram);
+
+	zcomp_destroy(zram->comp);
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	if (zram->recomp)
+		zcomp_destroy(zram->recomp);
+	zram->recomp = NULL;
+#endif
+	zram->max_comp_streams = 1;
+	zram->limit_pages = 0;
+
+	zram_meta_free(zram->meta);
+	zram->meta = NULL;
+	reset_bdev(zram);
+	/* Reset stats */
+	memset(&zram->stats, 0, sizeof(zram->stats));
+
+	zram->disksize = 0;
+	if (reset_capacity)
+		set_capacity(zram->disk, 0);
+
+	up_write(&zram->init_lock);
+
+	/*
+	 * Revalidate disk out of the init_lock to avoid lockdep splat.
+	 * It's okay because disk's capacity is protected by init_lock
+	 * so that revalidate_disk always sees up-to-date capacity.
+	 */
+	if (reset_capacity)
+		revalidate_disk(zram->disk);
+}
+
+static ssize_t disksize_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	u64 disksize;
+	struct zcomp *comp, *recomp = NULL;
+	struct zram_meta *meta;
+	struct zram *zram = dev_to_zram(dev);
+	int err;
+
+	disksize = memparse(buf, NULL);
+	if (!disksize)
+		return -EINVAL;
+
+	disksize = PAGE_ALIGN(disksize);
+	meta = zram_meta_alloc(disksize);
+	if (!meta)
+		return -ENOMEM;
+
+	comp = zcomp_create(zram->compressor, zram->max_comp_streams,
+			    zram->percpu_comp_streams);
+	if (IS_ERR(comp)) {
+		pr_info("Cannot initialise %s compressing backend\n",
+				zram->compressor);
+		err = PTR_ERR(comp);
+		goto out_free_meta;
+	}
+
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	if (zram->recomp_algorithm[0]) {
+		recomp = zcomp_create(zram->recomp_algorithm, 1, false);
+		if (IS_ERR(recomp)) {
+			pr_info("Cannot initialise %s recompressing backend\n",
+					zram->recomp_algorithm);
+			err = PTR_ERR(recomp);
+			zcomp_destroy(comp);
+			goto out_free_meta;
+		}
+	}
+#endif
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Cannot change disksize for initialized device\n");
+		err = -EBUSY;
+		goto out_destroy_comp;
+	}
+
+	err = zram_dedup_init(zram, disksize >> PAGE_SHIFT);
+	if (err)
+		goto out_destroy_comp;
+
+	zram->meta = meta;
+	zram->comp = comp;
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	zram->recomp = recomp;
+#endif
+	zram->disksize = disksize;
+	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
+	up_write(&zram->init_lock);
+
+	/*
+	 * Revalidate disk out of the init_lock to avoid lockdep splat.
+	 * It's okay because disk's capacity is protected by init_lock
+	 * so that revalidate_disk always sees up-to-date capacity.
+	 */
+	revalidate_disk(zram->disk);
+
+	return len;
+
+out_destroy_comp:
+	up_write(&zram->init_lock);
+	if (recomp)
+		zcomp_destroy(recomp);
+	zcomp_destroy(comp);
+out_free_meta:
+	zram_meta_free(meta);
+	return err;
+}
+
+static ssize_t reset_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned short do_reset;
+	struct zram *zram;
+	struct block_device *bdev;
+
+	zram = dev_to_zram(dev);
+	bdev = bdget_disk(zram->disk, 0);
+
+	if (!bdev)
+		return -ENOMEM;
+
+	/* Do not reset an active device! */
+	if (bdev->bd_holders) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = kstrtou16(buf, 10, &do_reset);
+	if (ret)
+		goto out;
+
+	if (!do_reset) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Make sure all pending I/O is finished */
+	fsync_bdev(bdev);
+	bdput(bdev);
+
+	zram_reset_device(zram, true);
+	return len;
+
+out:
+	bdput(bdev);
+	return ret;
+}
+
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MULTI_COMP)
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	size_t index, nr_pages;
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (meta->table[index].handle &&
+				!zram_test_flag(meta, index, ZRAM_WB) &&
+				!zram_test_flag(meta, index, ZRAM_SAME))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		cond_resched();
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+#endif
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Number of pages written back to the backing device per batch */
+#define ZRAM_WB_BATCH	32
+
+enum zram_wb_mode {
+	IDLE_WRITEBACK,
+	HUGE_WRITEBACK,
+};
+
+struct zram_wb_entry {
+	u32 index;
+	unsigned long blk_idx;
+	struct page *page;
+	struct bio *bio;
+};
+
+struct zram_wb_ctl {
+	atomic_t pending;
+	struct completion done;
+};
+
+/*
+ * Check whether slot @index is a writeback candidate for @mode and,
+ * if so, mark it ZRAM_UNDER_WB. ZRAM_IDLE is also set so that an
+ * access to the slot while the write is in flight (which clears
+ * ZRAM_IDLE) makes zram_wb_finish() keep the in-memory copy.
+ */
+static bool zram_wb_prepare(struct zram *zram, u32 index,
+			    enum zram_wb_mode mode)
+{
+	struct zram_meta *meta = zram->meta;
+	bool ret = false;
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_SAME) ||
+			zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_RECOMP))
+		goto out;
+
+	if (mode == IDLE_WRITEBACK &&
+			!zram_test_flag(meta, index, ZRAM_IDLE))
+		goto out;
+	if (mode == HUGE_WRITEBACK &&
+			!zram_test_flag(meta, index, ZRAM_HUGE))
+		goto out;
+
+	zram_set_flag(meta, index, ZRAM_UNDER_WB);
+	zram_set_flag(meta, index, ZRAM_IDLE);
+	ret = true;
+out:
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	return ret;
+}
+
+static void zram_wb_finish(struct zram *zram, struct zram_wb_entry *wb,
+			   int err)
+{
+	struct zram_meta *meta = zram->meta;
+	u32 index = wb->index;
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	/*
+	 * The slot was freed, rewritten or read while the write was
+	 * in flight: keep whatever is in memory and drop the block.
+	 */
+	if (err || !zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+			!zram_test_flag(meta, index, ZRAM_IDLE)) {
+		zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		free_block_bdev(zram, wb->blk_idx);
+		return;
+	}
+
+	zram_free_page(zram, index);
+	meta->table[index].handle = wb->blk_idx;
+	zram_set_flag(meta, index, ZRAM_WB);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	atomic64_inc(&zram->stats.pages_stored);
+	atomic64_inc(&zram->stats.bd_writes);
+}
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_ctl *ctl = bio->bi_private;
+
+	if (atomic_dec_and_test(&ctl->pending))
+		complete(&ctl->done);
+}
+
+/*
+ * Submit a batch of @nr pages under one plug so the block layer can
+ * merge neighbouring blocks, then wait for all of them to complete.
+ */
+static void zram_wb_submit(struct zram *zram, struct zram_wb_entry *wb,
+			   int nr)
+{
+	struct zram_wb_ctl ctl;
+	struct blk_plug plug;
+	int i, err;
+
+	atomic_set(&ctl.pending, nr);
+	init_completion(&ctl.done);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		struct bio *bio = bio_alloc(GFP_NOIO, 1);
+
+		bio->bi_sector = wb[i].blk_idx * (PAGE_SIZE >> SECTOR_SHIFT);
+		bio->bi_bdev = zram->bdev;
+		bio_add_page(bio, wb[i].page, PAGE_SIZE, 0);
+		bio->bi_end_io = zram_wb_end_io;
+		bio->bi_private = &ctl;
+		wb[i].bio = bio;
+		submit_bio(WRITE, bio);
+	}
+	blk_finish_plug(&plug);
+
+	wait_for_completion(&ctl.done);
+
+	for (i = 0; i < nr; i++) {
+		err = test_bit(BIO_UPTODATE, &wb[i].bio->bi_flags) ? 0 : -EIO;
+		bio_put(wb[i].bio);
+		zram_wb_finish(zram, &wb[i], err);
 	}
 }
 
-static void zram_reset_device(struct zram *zram, bool reset_capacity)
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
-	size_t index;
-	struct zram_meta *meta;
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_wb_entry *wb;
+	enum zram_wb_mode mode;
+	size_t index, nr_pages;
+	unsigned long blk_idx;
+	ssize_t ret = len;
+	int i, nr = 0;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = IDLE_WRITEBACK;
+	else if (sysfs_streq(buf, "huge"))
+		mode = HUGE_WRITEBACK;
+	else
+		return -EINVAL;
 
-	down_write(&zram->init_lock);
+	wb = kcalloc(ZRAM_WB_BATCH, sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return -ENOMEM;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		wb[i].page = alloc_page(GFP_KERNEL);
+		if (!wb[i].page) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	mutex_lock(&zram->wb_lock);
+	down_read(&zram->init_lock);
 	if (!init_done(zram)) {
-		up_write(&zram->init_lock);
-		return;
+		ret = -EINVAL;
+		goto out;
 	}
 
-	meta = zram->meta;
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		unsigned long handle = meta->table[index].handle;
-		if (!handle)
+	if (!zram->bdev) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		if (!zram_wb_prepare(zram, index, mode))
 			continue;
 
-		zs_free(meta->mem_pool, handle);
+		blk_idx = alloc_block_bdev(zram);
+		if (!blk_idx) {
+			bit_spin_lock(ZRAM_ACCESS,
+				      &zram->meta->table[index].value);
+			zram_clear_flag(zram->meta, index, ZRAM_UNDER_WB);
+			bit_spin_unlock(ZRAM_ACCESS,
+					&zram->meta->table[index].value);
+			ret = -ENOSPC;
+			break;
+		}
+
+		if (zram_decompress_page(zram, page_address(wb[nr].page),
+					 index)) {
+			bit_spin_lock(ZRAM_ACCESS,
+				      &zram->meta->table[index].value);
+			zram_clear_flag(zram->meta, index, ZRAM_UNDER_WB);
+			bit_spin_unlock(ZRAM_ACCESS,
+					&zram->meta->table[index].value);
+			free_block_bdev(zram, blk_idx);
+			continue;
+		}
+
+		wb[nr].index = index;
+		wb[nr].blk_idx = blk_idx;
+		if (++nr == ZRAM_WB_BATCH) {
+			zram_wb_submit(zram, wb, nr);
+			nr = 0;
+		}
+		cond_resched();
 	}
 
-	zcomp_destroy(zram->comp);
-	zram->max_comp_streams = 1;
+	if (nr)
+		zram_wb_submit(zram, wb, nr);
+out:
+	up_read(&zram->init_lock);
+	mutex_unlock(&zram->wb_lock);
+out_free:
+	for (i = 0; i < ZRAM_WB_BATCH && wb[i].page; i++)
+		__free_page(wb[i].page);
+	kfree(wb);
 
-	zram_meta_free(zram->meta);
-	zram->meta = NULL;
-	/* Reset stats */
-	memset(&zram->stats, 0, sizeof(zram->stats));
+	return ret;
+}
+#endif
 
-	zram->disksize = 0;
-	if (reset_capacity)
-		set_capacity(zram->disk, 0);
+#ifdef CONFIG_ZRAM_MULTI_COMP
+enum zram_recomp_mode {
+	IDLE_RECOMPRESS,
+	HUGE_RECOMPRESS,
+};
 
-	up_write(&zram->init_lock);
+/*
+ * Check whether slot @index is a recompression candidate for @mode and,
+ * if so, mark it ZRAM_UNDER_RECOMP. Freeing or rewriting the slot clears
+ * the mark, which tells zram_recompress_slot() to drop its new object.
+ */
+static bool zram_recomp_prepare(struct zram *zram, u32 index,
+				enum zram_recomp_mode mode)
+{
+	struct zram_meta *meta = zram->meta;
+	bool ret = false;
 
-	/*
-	 * Revalidate disk out of the init_lock to avoid lockdep splat.
-	 * It's okay because disk's capacity is protected by init_lock
-	 * so that revalidate_disk always sees up-to-date capacity.
-	 */
-	if (reset_capacity)
-		revalidate_disk(zram->disk);
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_SAME) ||
+			zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+			zram_test_flag(meta, index, ZRAM_RECOMP) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_RECOMP))
+		goto out;
+
+	if (mode == IDLE_RECOMPRESS &&
+			!zram_test_flag(meta, index, ZRAM_IDLE))
+		goto out;
+	if (mode == HUGE_RECOMPRESS &&
+			!zram_test_flag(meta, index, ZRAM_HUGE))
+		goto out;
+
+	zram_set_flag(meta, index, ZRAM_UNDER_RECOMP);
+	ret = true;
+out:
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	return ret;
 }
 
-static ssize_t disksize_store(struct device *dev,
-		struct device_attribute *attr, const char *buf, size_t len)
+/*
+ * Compress slot @index again with the secondary algorithm, using @mem
+ * as a page sized bounce buffer. The slot is only replaced if that
+ * saves memory.
+ */
+static int zram_recompress_slot(struct zram *zram, u32 index, void *mem)
 {
-	u64 disksize;
-	struct zcomp *comp;
-	struct zram_meta *meta;
-	struct zram *zram = dev_to_zram(dev);
-	int err;
+	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm;
+	unsigned long handle;
+	unsigned long alloced_pages;
+	unsigned char *cmem;
+	size_t clen, old_clen;
+	bool idle;
+	int ret;
 
-	disksize = memparse(buf, NULL);
-	if (!disksize)
-		return -EINVAL;
+	ret = zram_decompress_page(zram, mem, index);
+	if (ret)
+		goto out_clear;
 
-	disksize = PAGE_ALIGN(disksize);
-	meta = zram_meta_alloc(disksize);
-	if (!meta)
-		return -ENOMEM;
+	zstrm = zcomp_strm_find_sleepable(zram->recomp);
+	ret = zcomp_compress(zram->recomp, zstrm, mem, &clen);
+	if (ret)
+		goto out_release;
 
-	comp = zcomp_create(zram->compressor, zram->max_comp_streams);
-	if (IS_ERR(comp)) {
-		pr_info("Cannot initialise %s compressing backend\n",
-				zram->compressor);
-		err = PTR_ERR(comp);
-		goto out_free_meta;
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	old_clen = zram_get_obj_size(meta, index);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	if (clen >= old_clen || clen > max_zpage_size)
+		goto out_release;
+
+	handle = zs_malloc(meta->mem_pool, clen,
+			   GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!handle) {
+		ret = -ENOMEM;
+		goto out_release;
 	}
 
-	down_write(&zram->init_lock);
-	if (init_done(zram)) {
-		pr_info("Cannot change disksize for initialized device\n");
-		err = -EBUSY;
-		goto out_destroy_comp;
+	alloced_pages = zs_get_total_pages(meta->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(meta->mem_pool, handle);
+		ret = -ENOMEM;
+		goto out_release;
 	}
 
-	zram->meta = meta;
-	zram->comp = comp;
-	zram->disksize = disksize;
-	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
-	up_write(&zram->init_lock);
+	update_used_max(zram, alloced_pages);
 
-	/*
-	 * Revalidate disk out of the init_lock to avoid lockdep splat.
-	 * It's okay because disk's capacity is protected by init_lock
-	 * so that revalidate_disk always sees up-to-date capacity.
-	 */
-	revalidate_disk(zram->disk);
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(meta->mem_pool, handle);
+	zcomp_strm_release(zram->recomp, zstrm);
 
-	return len;
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!zram_test_flag(meta, index, ZRAM_UNDER_RECOMP)) {
+		/* the slot was freed or rewritten in the meantime */
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zs_free(meta->mem_pool, handle);
+		return 0;
+	}
 
-out_destroy_comp:
-	up_write(&zram->init_lock);
-	zcomp_destroy(comp);
-out_free_meta:
-	zram_meta_free(meta);
-	return err;
+	idle = zram_test_flag(meta, index, ZRAM_IDLE);
+	zram_free_page(zram, index);
+	meta->table[index].handle = handle;
+	zram_set_obj_size(meta, index, clen);
+	zram_set_flag(meta, index, ZRAM_RECOMP);
+	if (idle)
+		zram_set_flag(meta, index, ZRAM_IDLE);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	atomic64_inc(&zram->stats.pages_stored);
+	return 0;
+
+out_release:
+	zcomp_strm_release(zram->recomp, zstrm);
+out_clear:
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	return ret;
 }
 
-static ssize_t reset_store(struct device *dev,
+static ssize_t recompress_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
-	int ret;
-	unsigned short do_reset;
-	struct zram *zram;
-	struct block_device *bdev;
+	struct zram *zram = dev_to_zram(dev);
+	enum zram_recomp_mode mode;
+	size_t index, nr_pages;
+	struct page *page;
+	ssize_t ret = len;
+	int err;
 
-	zram = dev_to_zram(dev);
-	bdev = bdget_disk(zram->disk, 0);
+	if (sysfs_streq(buf, "idle"))
+		mode = IDLE_RECOMPRESS;
+	else if (sysfs_streq(buf, "huge"))
+		mode = HUGE_RECOMPRESS;
+	else
+		return -EINVAL;
 
-	if (!bdev)
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
 		return -ENOMEM;
 
-	/* Do not reset an active device! */
-	if (bdev->bd_holders) {
-		ret = -EBUSY;
+	mutex_lock(&zram->recomp_lock);
+	down_read(&zram->init_lock);
+	if (!init_done(zram) || !zram->recomp) {
+		ret = -EINVAL;
 		goto out;
 	}
 
-	ret = kstrtou16(buf, 10, &do_reset);
-	if (ret)
-		goto out;
-
-	if (!do_reset) {
-		ret = -EINVAL;
+	/* a shared object can't be replaced on behalf of a single slot */
+	if (zram_dedup_enabled(zram)) {
+		ret = -EOPNOTSUPP;
 		goto out;
 	}
 
-	/* Make sure all pending I/O is finished */
-	fsync_bdev(bdev);
-	bdput(bdev);
-
-	zram_reset_device(zram, true);
-	return len;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		if (!zram_recomp_prepare(zram, index, mode))
+			continue;
 
+		err = zram_recompress_slot(zram, index, page_address(page));
+		if (err == -ENOMEM) {
+			ret = err;
+			break;
+		}
+		cond_resched();
+	}
 out:
-	bdput(bdev);
+	up_read(&zram->init_lock);
+	mutex_unlock(&zram->recomp_lock);
+	__free_page(page);
+
 	return ret;
 }
+#endif
 
 static void __zram_make_request(struct zram *zram, struct bio *bio)
 {
@@ -818,6 +1961,140 @@ out:
 	bio_io_error(bio);
 }
 
+/* An asynchronous write bio, completed once all its chunks are stored */
+struct zram_async_bio {
+	struct zram *zram;
+	struct bio *bio;
+	atomic_t pending;
+	int error;
+};
+
+/* A run of whole-page segments of the bio, stored by one worker */
+struct zram_async_work {
+	struct work_struct work;
+	struct zram_async_bio *ab;
+	u32 index;
+	unsigned short first;
+	unsigned short nr;
+};
+
+static void zram_async_bio_put(struct zram_async_bio *ab)
+{
+	struct zram *zram = ab->zram;
+
+	if (!atomic_dec_and_test(&ab->pending))
+		return;
+
+	if (ab->error) {
+		bio_io_error(ab->bio);
+	} else {
+		set_bit(BIO_UPTODATE, &ab->bio->bi_flags);
+		bio_endio(ab->bio, 0);
+	}
+	kfree(ab);
+
+	if (atomic_dec_and_test(&zram->async_pending))
+		wake_up(&zram->async_wait);
+}
+
+static void zram_async_write(struct zram_async_work *aw)
+{
+	struct zram_async_bio *ab = aw->ab;
+	struct bio *bio = ab->bio;
+	int i;
+
+	for (i = 0; i < aw->nr; i++) {
+		if (zram_bvec_rw(ab->zram, bio_iovec_idx(bio, aw->first + i),
+				 aw->index + i, 0, bio) < 0)
+			ab->error = 1;
+	}
+	zram_async_bio_put(ab);
+}
+
+static void zram_async_write_work(struct work_struct *work)
+{
+	zram_async_write(container_of(work, struct zram_async_work, work));
+}
+
+/*
+ * Only writes of several whole pages are worth spreading over the
+ * workers. Reads, discards and partial pages stay synchronous.
+ */
+static bool zram_can_write_async(struct zram *zram, struct bio *bio)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	if (!ACCESS_ONCE(zram->async_write) || bio_data_dir(bio) != WRITE ||
+			(bio->bi_rw & REQ_DISCARD))
+		return false;
+
+	if (bio_segments(bio) < 2 || num_online_cpus() < 2)
+		return false;
+
+	if (bio->bi_sector & (SECTORS_PER_PAGE - 1))
+		return false;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (bvec->bv_len != PAGE_SIZE)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Split a write bio into one chunk per online CPU. The submitter stores
+ * the first chunk itself and the workers the rest; whoever finishes last
+ * completes the bio.
+ */
+static void zram_make_request_async(struct zram *zram, struct bio *bio)
+{
+	struct zram_async_bio *ab;
+	struct zram_async_work *aw;
+	int nr_segs = bio_segments(bio);
+	int nr_chunks = min_t(int, num_online_cpus(), nr_segs);
+	int chunk = DIV_ROUND_UP(nr_segs, nr_chunks);
+	int i, cpu, first = bio->bi_idx;
+	u32 index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	nr_chunks = DIV_ROUND_UP(nr_segs, chunk);
+	ab = kmalloc(sizeof(*ab) + nr_chunks * sizeof(*aw),
+		     GFP_NOIO | __GFP_NOWARN);
+	if (!ab) {
+		__zram_make_request(zram, bio);
+		return;
+	}
+
+	ab->zram = zram;
+	ab->bio = bio;
+	ab->error = 0;
+	atomic_set(&ab->pending, nr_chunks);
+	atomic_inc(&zram->async_pending);
+
+	aw = (struct zram_async_work *)(ab + 1);
+	for (i = 0; i < nr_chunks; i++) {
+		aw[i].ab = ab;
+		aw[i].first = first;
+		aw[i].nr = min(chunk, nr_segs);
+		aw[i].index = index;
+		INIT_WORK(&aw[i].work, zram_async_write_work);
+
+		first += aw[i].nr;
+		index += aw[i].nr;
+		nr_segs -= aw[i].nr;
+	}
+
+	cpu = raw_smp_processor_id();
+	for (i = 1; i < nr_chunks; i++) {
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		queue_work_on(cpu, zram_wq, &aw[i].work);
+	}
+
+	zram_async_write(&aw[0]);
+}
+
 /*
  * Handler function for all zram I/O requests.
  */
@@ -834,7 +2111,10 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error;
 	}
 
-	__zram_make_request(zram, bio);
+	if (zram_can_write_async(zram, bio))
+		zram_make_request_async(zram, bio);
+	else
+		__zram_make_request(zram, bio);
 	up_read(&zram->init_lock);
 
 	return 0;
@@ -872,8 +2152,18 @@ static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(mem_limit, S_IRUGO | S_IWUSR, mem_limit_show,
+		mem_limit_store);
+static DEVICE_ATTR(mem_used_max, S_IRUGO | S_IWUSR, mem_used_max_show,
+		mem_used_max_store);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
 static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
 		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(percpu_comp_streams, S_IRUGO | S_IWUSR,
+		percpu_comp_streams_show, percpu_comp_streams_store);
+static DEVICE_ATTR(async_write, S_IRUGO | S_IWUSR,
+		async_write_show, async_write_store);
 static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
 		comp_algorithm_show, comp_algorithm_store);
 
@@ -884,7 +2174,34 @@ ZRAM_ATTR_RO(failed_writes);
 ZRAM_ATTR_RO(invalid_io);
 ZRAM_ATTR_RO(notify_free);
 ZRAM_ATTR_RO(zero_pages);
+ZRAM_ATTR_RO(same_pages);
 ZRAM_ATTR_RO(compr_data_size);
+ZRAM_ATTR_RO(huge_pages);
+ZRAM_ATTR_RO(writestall);
+#ifdef CONFIG_ZRAM_DEDUP
+ZRAM_ATTR_RO(dup_data_size);
+ZRAM_ATTR_RO(meta_data_size);
+
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+#endif
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MULTI_COMP)
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+ZRAM_ATTR_RO(bd_count);
+ZRAM_ATTR_RO(bd_reads);
+ZRAM_ATTR_RO(bd_writes);
+
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+static DEVICE_ATTR(recomp_algorithm, S_IRUGO | S_IWUSR,
+		recomp_algorithm_show, recomp_algorithm_store);
+static DEVICE_ATTR(recompress, S_IWUSR, NULL, recompress_store);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -897,11 +2214,39 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_mem_limit.attr,
+	&dev_attr_mem_used_max.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_pages_compacted.attr,
 	&dev_attr_max_comp_streams.attr,
+	&dev_attr_percpu_comp_streams.attr,
+	&dev_attr_async_write.attr,
 	&dev_attr_comp_algorithm.attr,
+	&dev_attr_huge_pages.attr,
+	&dev_attr_writestall.attr,
+#ifdef CONFIG_ZRAM_DEDUP
+	&dev_attr_use_dedup.attr,
+	&dev_attr_dup_data_size.attr,
+	&dev_attr_meta_data_size.attr,
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
+#endif
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MULTI_COMP)
+	&dev_attr_idle.attr,
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	&dev_attr_recomp_algorithm.attr,
+	&dev_attr_recompress.attr,
+#endif
 	NULL,
 };
 
@@ -914,6 +2259,14 @@ static int create_device(struct zram *zram, int device_id)
 	int ret = -ENOMEM;
 
 	init_rwsem(&zram->init_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	mutex_init(&zram->wb_lock);
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	mutex_init(&zram->recomp_lock);
+#endif
+	init_waitqueue_head(&zram->async_wait);
+	atomic_set(&zram->async_pending, 0);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -1014,11 +2367,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_wq = alloc_workqueue("zram", WQ_MEM_RECLAIM, 0);
+	if (!zram_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warn("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -1044,6 +2403,8 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+	destroy_workqueue(zram_wq);
 out:
 	return ret;
 }
@@ -1065,6 +2426,7 @@ static void __exit zram_exit(void)
 	}
 
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_wq);
 
 	kfree(zram_devices);
 	pr_debug("Cleanup done!\n");
@@ -17,6 +17,9 @@
 #define _ZRAM_DRV_H_
 
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/rbtree.h>
 #include <linux/zsmalloc.h>
 
 #include "zcomp.h"
@@ -61,14 +64,23 @@ static const size_t max_zpage_size = PAGE_SIZE / 10 * 9;
  * footprint small so we can squeeze size and flags into a field.
  * The lower ZRAM_FLAG_SHIFT bits is for object size (excluding header),
  * the higher bits is for zram_pageflags.
+ *
+ * An object is never larger than PAGE_SIZE, so PAGE_SHIFT + 1 bits are
+ * enough for the size and leave room for flags on 32-bit machines.
  */
-#define ZRAM_FLAG_SHIFT 24
+#define ZRAM_FLAG_SHIFT (PAGE_SHIFT + 1)
 
 /* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO = ZRAM_FLAG_SHIFT + 1,
+	/* Page consists of the same element, kept in table.handle */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT + 1,
 	ZRAM_ACCESS,	/* page in now accessed */
+	ZRAM_WB,	/* page is stored on backing_device */
+	ZRAM_UNDER_WB,	/* page is under writeback */
+	ZRAM_HUGE,	/* Incompressible page */
+	ZRAM_IDLE,	/* not accessed page since last idle marking */
+	ZRAM_RECOMP,	/* page is compressed with the secondary algorithm */
+	ZRAM_UNDER_RECOMP,	/* page is under recompression */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -81,6 +93,26 @@ struct zram_table_entry {
 	unsigned long value;
 };
 
+/*
+ * With dedup enabled, table[index].handle of a compressed slot points to
+ * one of these instead of holding the zsmalloc handle directly. Slots
+ * with identical content share one refcounted entry.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 len;
+	u32 checksum;
+	unsigned long refcount;	/* protected by zram_hash.lock */
+	unsigned long handle;	/* zsmalloc handle */
+};
+
+#ifdef CONFIG_ZRAM_DEDUP
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+#endif
+
 struct zram_stats {
 	atomic64_t compr_data_size;	/* compressed size of pages stored */
 	atomic64_t num_reads;	/* failed + successful */
@@ -90,7 +122,20 @@ struct zram_stats {
 	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
 	atomic64_t zero_pages;		/* no. of zero filled pages */
+	atomic64_t same_pages;		/* no. of same element filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t huge_pages;		/* no. of huge pages */
+	atomic64_t writestall;		/* no. of write slow paths */
+	atomic_long_t max_used_pages;	/* no. of maximum pages stored */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic64_t bd_count;		/* no. of pages in backing device */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes to backing device */
+#endif
+#ifdef CONFIG_ZRAM_DEDUP
+	atomic64_t dup_data_size;	/* compressed size of pages shared */
+	atomic64_t meta_data_size;	/* size of zram_entries */
+#endif
 };
 
 struct zram_meta {
@@ -111,8 +156,39 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* zero means no limit on the zsmalloc pool size */
+	unsigned long limit_pages;
 	int max_comp_streams;
+	/* compress with per-CPU streams, falling back to max_comp_streams */
+	bool percpu_comp_streams;
+	/* spread multi-page write bios over the zram workqueue */
+	bool async_write;
+	/* asynchronous write bios not yet completed */
+	atomic_t async_pending;
+	wait_queue_head_t async_wait;
 	struct zram_stats stats;
 	char compressor[10];
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Block device idle and incompressible pages are written back to */
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	char *backing_dev_name;
+	unsigned long nr_pages;		/* size of bdev in pages */
+	unsigned long *bitmap;		/* allocated blocks of bdev */
+	struct mutex wb_lock;		/* serialises writeback passes */
+#endif
+#ifdef CONFIG_ZRAM_DEDUP
+	bool use_dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	/* secondary compression backend, NULL if none was selected */
+	struct zcomp *recomp;
+	char recomp_algorithm[10];
+	struct mutex recomp_lock;	/* serialises recompression passes */
+#endif
 };
+
+#include "zram_dedup.h"
 #endif
@@ -15,7 +15,11 @@
  */
 
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
 #include "ion_priv.h"
 
 struct ion_heap *ion_heap_create(struct ion_platform_heap *heap_data)
@@ -72,3 +76,139 @@ void ion_heap_destroy(struct ion_heap *heap)
 		       heap->type);
 	}
 }
+
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer)
+{
+	spin_lock(&heap->free_lock);
+	list_add(&buffer->list, &heap->free_list);
+	heap->free_list_size += buffer->size;
+	spin_unlock(&heap->free_lock);
+	wake_up(&heap->waitqueue);
+}
+
+size_t ion_heap_freelist_size(struct ion_heap *heap)
+{
+	size_t size;
+
+	spin_lock(&heap->free_lock);
+	size = heap->free_list_size;
+	spin_unlock(&heap->free_lock);
+
+	return size;
+}
+
+static struct ion_buffer *ion_heap_freelist_pop(struct ion_heap *heap)
+{
+	struct ion_buffer *buffer = NULL;
+
+	spin_lock(&heap->free_lock);
+	if (!list_empty(&heap->free_list)) {
+		buffer = list_first_entry(&heap->free_list, struct ion_buffer,
+					  list);
+		list_del(&buffer->list);
+		heap->free_list_size -= buffer->size;
+	}
+	spin_unlock(&heap->free_lock);
+
+	return buffer;
+}
+
+/*
+ * Free buffers from the deferred list right away, until at least @size
+ * bytes are gone or the list is empty; zero means all of them. The memory
+ * goes back to the system rather than to any cache the heap keeps.
+ * Returns the number of bytes freed.
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size)
+{
+	struct ion_buffer *buffer;
+	size_t total_drained = 0;
+
+	while (!size || total_drained < size) {
+		buffer = ion_heap_freelist_pop(heap);
+		if (!buffer)
+			break;
+		total_drained += buffer->size;
+		buffer->private_flags |= ION_PRIV_FLAG_SHRINKER_FREE;
+		ion_buffer_destroy(buffer);
+	}
+
+	return total_drained;
+}
+
+static int ion_heap_deferred_free(void *data)
+{
+	struct ion_heap *heap = data;
+	struct ion_buffer *buffer;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		wait_event_freezable(heap->waitqueue,
+				     ion_heap_freelist_size(heap) > 0 ||
+				     kthread_should_stop());
+
+		while (!kthread_should_stop() &&
+		       (buffer = ion_heap_freelist_pop(heap)))
+			ion_buffer_destroy(buffer);
+	}
+
+	return 0;
+}
+
+/*
+ * Buffers waiting on the deferred list still pin their memory, so report
+ * them to reclaim and free them on demand.
+ */
+static int ion_heap_shrink(struct shrinker *shrinker,
+			   struct shrink_control *sc)
+{
+	struct ion_heap *heap = container_of(shrinker, struct ion_heap,
+					     shrinker);
+
+	if (sc->nr_to_scan)
+		ion_heap_freelist_drain(heap, sc->nr_to_scan * PAGE_SIZE);
+
+	return ion_heap_freelist_size(heap) / PAGE_SIZE;
+}
+
+int ion_heap_init_deferred_free(struct ion_heap *heap)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	INIT_LIST_HEAD(&heap->free_list);
+	heap->free_list_size = 0;
+	spin_lock_init(&heap->free_lock);
+	init_waitqueue_head(&heap->waitqueue);
+	heap->task = kthread_run(ion_heap_deferred_free, heap,
+				 "%s", heap->name);
+	if (IS_ERR(heap->task)) {
+		pr_err("%s: creating thread for deferred free failed\n",
+		       __func__);
+		return PTR_ERR(heap->task);
+	}
+	sched_setscheduler(heap->task, SCHED_IDLE, &param);
+
+	heap->shrinker.shrink = ion_heap_shrink;
+	heap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&heap->shrinker);
+
+	return 0;
+}
+
+/*
+ * Undo ion_heap_init_deferred_free(): stop the thread and the shrinker,
+ * and free whatever is still waiting on the list. The heap's free op is
+ * called for those buffers, so this must run before the heap tears down
+ * its own state.
+ */
+void ion_heap_deinit_deferred_free(struct ion_heap *heap)
+{
+	/* never added, or ion_heap_init_deferred_free() failed */
+	if (!(heap->flags & ION_HEAP_FLAG_DEFER_FREE) || !heap->task)
+		return;
+
+	unregister_shrinker(&heap->shrinker);
+	kthread_stop(heap->task);
+	heap->task = NULL;
+	ion_heap_freelist_drain(heap, 0);
+}
@@ -0,0 +1,323 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/freezer.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include "ion_priv.h"
+
+/**
+ * struct ion_page_pool - pagepool struct
+ * @clean_count:	number of zeroed items in the pool
+ * @dirty_count:	number of items still waiting to be zeroed
+ * @clean_items:	list of zeroed pages, ready to hand out
+ * @dirty_items:	list of freed pages the zeroing thread has not reached
+ * @zeroing:		number of pages the zeroing thread has taken off
+ *			dirty_items and not yet put back on clean_items
+ * @mutex:		lock protecting this struct and especially the counts
+ *			and item lists
+ * @gfp_mask:		gfp_mask to use for allocations from the page allocator
+ * @order:		order of pages in the pool
+ * @list:		entry in the list of all pools
+ *
+ * Freed pages are put on the dirty list and zeroed by a background thread,
+ * so allocation normally only has to unlink an already clean page.
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	atomic_t zeroing;
+	struct mutex mutex;
+	gfp_t gfp_mask;
+	unsigned int order;
+	struct list_head list;
+};
+
+/* all pools, protected by ion_page_pools_lock */
+static LIST_HEAD(ion_page_pools);
+static DEFINE_MUTEX(ion_page_pools_lock);
+
+static atomic_t ion_page_pool_nr_dirty = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(ion_page_pool_wait);
+static DECLARE_WAIT_QUEUE_HEAD(ion_page_pool_zeroed_wait);
+static struct task_struct *ion_page_pool_task;
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(nth_page(page, i));
+}
+
+static void ion_page_pool_add(struct ion_page_pool *pool, struct page *page,
+			      bool dirty)
+{
+	mutex_lock(&pool->mutex);
+	if (dirty) {
+		list_add_tail(&page->lru, &pool->dirty_items);
+		pool->dirty_count++;
+		atomic_inc(&ion_page_pool_nr_dirty);
+	} else {
+		list_add_tail(&page->lru, &pool->clean_items);
+		pool->clean_count++;
+	}
+	mutex_unlock(&pool->mutex);
+}
+
+/* Caller must hold pool->mutex */
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool,
+					 bool dirty)
+{
+	struct page *page;
+
+	if (dirty) {
+		if (!pool->dirty_count)
+			return NULL;
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		pool->dirty_count--;
+		atomic_dec(&ion_page_pool_nr_dirty);
+	} else {
+		if (!pool->clean_count)
+			return NULL;
+		page = list_first_entry(&pool->clean_items, struct page, lru);
+		pool->clean_count--;
+	}
+	list_del(&page->lru);
+
+	return page;
+}
+
+/*
+ * Take a dirty page off any pool.  The pool cannot be destroyed before
+ * the page is given back with ion_page_pool_put_zeroed().
+ */
+static struct page *ion_page_pool_get_dirty(struct ion_page_pool **ppool)
+{
+	struct ion_page_pool *pool;
+	struct page *page = NULL;
+
+	mutex_lock(&ion_page_pools_lock);
+	list_for_each_entry(pool, &ion_page_pools, list) {
+		mutex_lock(&pool->mutex);
+		page = ion_page_pool_remove(pool, true);
+		if (page)
+			atomic_inc(&pool->zeroing);
+		mutex_unlock(&pool->mutex);
+		if (page) {
+			*ppool = pool;
+			break;
+		}
+	}
+	mutex_unlock(&ion_page_pools_lock);
+
+	return page;
+}
+
+static void ion_page_pool_put_zeroed(struct ion_page_pool *pool,
+				     struct page *page)
+{
+	ion_page_pool_add(pool, page, false);
+	/* after this, ion_page_pool_destroy() may free the pool */
+	smp_mb__before_atomic_dec();
+	atomic_dec(&pool->zeroing);
+	wake_up(&ion_page_pool_zeroed_wait);
+}
+
+/*
+ * Pages are zeroed with no lock held, one at a time, so neither the
+ * shrinker nor pool creation and allocation ever wait for the clearing.
+ */
+static int ion_page_pool_zero_thread(void *data)
+{
+	struct ion_page_pool *pool;
+	struct page *page;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		wait_event_freezable(ion_page_pool_wait,
+				     atomic_read(&ion_page_pool_nr_dirty) ||
+				     kthread_should_stop());
+
+		while (!kthread_should_stop() &&
+		       (page = ion_page_pool_get_dirty(&pool))) {
+			ion_page_pool_zero(pool, page);
+			ion_page_pool_put_zeroed(pool, page);
+			cond_resched();
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ion_page_pool_alloc - allocate a zeroed page of the pool's order
+ * @pool:		the pool
+ *
+ * Falls back to the page allocator when the pool is empty, and returns
+ * NULL if that fails too.
+ */
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page;
+	bool dirty = false;
+
+	mutex_lock(&pool->mutex);
+	page = ion_page_pool_remove(pool, false);
+	if (!page) {
+		page = ion_page_pool_remove(pool, true);
+		dirty = page != NULL;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!page)
+		return alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+
+	/* the zeroing thread has not got to it yet, reusing still wins */
+	if (dirty)
+		ion_page_pool_zero(pool, page);
+
+	return page;
+}
+
+/**
+ * ion_page_pool_free - give a page back to the pool
+ * @pool:		the pool the page was allocated from
+ * @page:		the page, possibly holding stale data
+ */
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	ion_page_pool_add(pool, page, true);
+	wake_up(&ion_page_pool_wait);
+}
+
+static int ion_page_pool_total(struct ion_page_pool *pool)
+{
+	return (pool->clean_count + pool->dirty_count) << pool->order;
+}
+
+/*
+ * Pool pages are only a cache, so under memory pressure give them back to
+ * the page allocator, starting with the ones nobody has zeroed yet.
+ */
+static int ion_page_pool_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct ion_page_pool *pool;
+	struct page *page;
+	unsigned long nr_to_scan = sc->nr_to_scan;
+	int count = 0;
+
+	if (!mutex_trylock(&ion_page_pools_lock))
+		return nr_to_scan ? -1 : 0;
+
+	list_for_each_entry(pool, &ion_page_pools, list) {
+		mutex_lock(&pool->mutex);
+		while (nr_to_scan) {
+			page = ion_page_pool_remove(pool, true);
+			if (!page)
+				page = ion_page_pool_remove(pool, false);
+			if (!page)
+				break;
+			__free_pages(page, pool->order);
+			nr_to_scan -= min_t(unsigned long, nr_to_scan,
+					    1 << pool->order);
+		}
+		count += ion_page_pool_total(pool);
+		mutex_unlock(&pool->mutex);
+	}
+	mutex_unlock(&ion_page_pools_lock);
+
+	return count;
+}
+
+static struct shrinker ion_page_pool_shrinker = {
+	.shrink = ion_page_pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/**
+ * ion_page_pool_create - create a pool of pages of one order
+ * @gfp_mask:		flags for allocations that miss the pool
+ * @order:		order of the pages handed out
+ *
+ * The first pool also starts the zeroing thread and registers the shrinker
+ * that drains every pool. Returns NULL on failure.
+ */
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool;
+	struct task_struct *task;
+
+	pool = kzalloc(sizeof(struct ion_page_pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	atomic_set(&pool->zeroing, 0);
+	mutex_init(&pool->mutex);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+
+	mutex_lock(&ion_page_pools_lock);
+	if (!ion_page_pool_task) {
+		task = kthread_run(ion_page_pool_zero_thread, NULL,
+				   "ion_pool_zero");
+		if (IS_ERR(task)) {
+			mutex_unlock(&ion_page_pools_lock);
+			pr_err("%s: failed to start zeroing thread\n",
+			       __func__);
+			kfree(pool);
+			return NULL;
+		}
+		ion_page_pool_task = task;
+		register_shrinker(&ion_page_pool_shrinker);
+	}
+	list_add_tail(&pool->list, &ion_page_pools);
+	mutex_unlock(&ion_page_pools_lock);
+
+	return pool;
+}
+
+/**
+ * ion_page_pool_destroy - free a pool and every page it still holds
+ * @pool:		the pool
+ */
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	mutex_lock(&ion_page_pools_lock);
+	list_del(&pool->list);
+	mutex_unlock(&ion_page_pools_lock);
+
+	/* the zeroing thread may still be clearing one of our pages */
+	wait_event(ion_page_pool_zeroed_wait, !atomic_read(&pool->zeroing));
+
+	while ((page = ion_page_pool_remove(pool, true)))
+		__free_pages(page, pool->order);
+	while ((page = ion_page_pool_remove(pool, false)))
+		__free_pages(page, pool->order);
+	kfree(pool);
+}
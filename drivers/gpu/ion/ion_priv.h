@@ -23,6 +23,9 @@
 #include <linux/rbtree.h>
 #include <linux/ion.h>
 #include <linux/miscdevice.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 
 /**
  * struct ion_device - the metadata of the ion device node
@@ -101,9 +104,11 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
  * @node:		node in the ion_device buffers tree
+ * @list:		entry in the heap's deferred free list
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
  * @flags:		buffer specific flags
+ * @private_flags:	internal buffer specific flags (ION_PRIV_FLAG_*)
  * @size:		size of the buffer
  * @priv_virt:		private data to the buffer representable as
  *			a void *
@@ -118,9 +123,11 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 struct ion_buffer {
 	struct kref ref;
 	struct rb_node node;
+	struct list_head list;
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
+	unsigned long private_flags;
 	size_t size;
 	union {
 		void *priv_virt;
@@ -134,6 +141,14 @@ struct ion_buffer {
 	bool cached;
 };
 
+/*
+ * The buffer is being freed to relieve memory pressure, so the heap should
+ * give its memory straight back to the system rather than cache it.
+ */
+#define ION_PRIV_FLAG_SHRINKER_FREE	(1 << 0)
+
+void ion_buffer_destroy(struct ion_buffer *buffer);
+
 /**
  * struct ion_heap_ops - ops to operate on a given heap
  * @allocate:		allocate memory
@@ -178,6 +193,13 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @flags:		ION_HEAP_FLAG_* describing optional heap behaviour
+ * @free_list:		buffers waiting to be freed, with ION_HEAP_FLAG_DEFER_FREE
+ * @free_list_size:	total size of the buffers on free_list
+ * @free_lock:		protects free_list and free_list_size
+ * @waitqueue:		wakes the deferred free thread
+ * @task:		the deferred free thread
+ * @shrinker:		drains free_list under memory pressure
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -191,8 +213,21 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	unsigned long flags;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct shrinker shrinker;
 };
 
+/*
+ * Free buffers from a low priority thread instead of in the context of
+ * whoever dropped the last reference.
+ */
+#define ION_HEAP_FLAG_DEFER_FREE	(1 << 0)
+
 /**
  * ion_device_create - allocates and returns an ion device
  * @custom_ioctl:	arch specific ioctl function if applicable
@@ -226,6 +261,16 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap);
 struct ion_heap *ion_heap_create(struct ion_platform_heap *);
 void ion_heap_destroy(struct ion_heap *);
 
+/**
+ * functions for deferred freeing, used by heaps with
+ * ION_HEAP_FLAG_DEFER_FREE set. ion_device_add_heap() sets them up.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+void ion_heap_deinit_deferred_free(struct ion_heap *heap);
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *);
 void ion_system_heap_destroy(struct ion_heap *);
 
@@ -248,6 +293,18 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * functions for pools of pages of a single order, used by heaps that
+ * allocate from system memory to avoid going to the page allocator and
+ * zeroing on every allocation. Pages come back zeroed.
+ */
+struct ion_page_pool;
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+
 /**
  * Flushing entire cache is more efficient than flushing virtual address
  * range of a buffer whose size is 200Kbytes or higher, since line by
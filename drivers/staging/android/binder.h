@@ -35,8 +35,16 @@ enum {
 };
 
 enum {
+	/*
+	 * Minimum priority the node's transactions are handled at: a nice
+	 * value for SCHED_NORMAL and SCHED_BATCH, an RT priority for
+	 * SCHED_FIFO and SCHED_RR.
+	 */
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/* Scheduling policy that goes with the minimum priority. */
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
 };
 
 /*
@@ -17,6 +17,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Setting /sys/module/lowmemorykiller/parameters/vmpressure_kill also kills
+ * from system-wide vmpressure events at or above vmpressure_level percent,
+ * checking only the file cache against minfree. With "reap" set, a kernel
+ * thread unmaps each victim's private memory as soon as it is killed.
+ * "swap_aware" lowers the minfree thresholds by up to half while swap is
+ * still free.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -41,6 +48,12 @@
 #include <linux/delay.h>
 #include <linux/swap.h>
 #include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/vmpressure.h>
+#include <linux/math64.h>
 
 #ifdef CONFIG_HIGHMEM
 #define _ZONE ZONE_HIGHMEM
@@ -68,6 +81,10 @@ static int lmk_fast_run = 1;
 #endif
 
 static unsigned long lowmem_deathpending_timeout;
+static bool lowmem_reap;
+static bool lowmem_vmpressure_kill;
+static unsigned int lowmem_vmpressure_level = 95;
+static bool lowmem_swap_aware;
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -93,6 +110,86 @@ static int test_task_flag(struct task_struct *p, int flag)
 
 static DEFINE_MUTEX(scan_mutex);
 
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+/*
+ * Thread groups indexed by oom_score_adj, so lowmem_shrink() only has to
+ * look at the highest buckets instead of walking every process. Each
+ * signal_struct is keyed by adj_key, the value it had when last inserted;
+ * writers of oom_score_adj call lowmem_adj_tree_update() afterwards to
+ * move it. tasklist_lock is taken for reading from interrupt context and
+ * fork/exit update the tree with it held for writing, so the lock must be
+ * taken with interrupts disabled. The shrinker takes task_lock() under it,
+ * so nothing may take it while holding task_lock() or a siglock.
+ */
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static struct rb_root lowmem_adj_root = RB_ROOT;
+
+static void lowmem_adj_tree_insert(struct signal_struct *sig)
+{
+	struct rb_node **link = &lowmem_adj_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct signal_struct *entry;
+
+	sig->adj_key = sig->oom_score_adj;
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct signal_struct, adj_node);
+		if (sig->adj_key < entry->adj_key)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&sig->adj_node, parent, link);
+	rb_insert_color(&sig->adj_node, &lowmem_adj_root);
+}
+
+static void lowmem_adj_tree_erase(struct signal_struct *sig)
+{
+	rb_erase(&sig->adj_node, &lowmem_adj_root);
+	RB_CLEAR_NODE(&sig->adj_node);
+}
+
+/* Called from copy_process() with tasklist_lock held for writing */
+void lowmem_adj_tree_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	if (RB_EMPTY_NODE(&p->signal->adj_node))
+		lowmem_adj_tree_insert(p->signal);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* Called from release_task() with tasklist_lock held for writing */
+void lowmem_adj_tree_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	if (!RB_EMPTY_NODE(&p->signal->adj_node))
+		lowmem_adj_tree_erase(p->signal);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/*
+ * Re-key @p's thread group after its oom_score_adj was written. The caller
+ * must hold a reference on @p and must not hold task_lock() or siglock.
+ */
+void lowmem_adj_tree_update(struct task_struct *p)
+{
+	struct signal_struct *sig = p->signal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	if (!RB_EMPTY_NODE(&sig->adj_node) &&
+	    sig->adj_key != sig->oom_score_adj) {
+		lowmem_adj_tree_erase(sig);
+		lowmem_adj_tree_insert(sig);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+#endif
+
 #ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
 /*
  * The # of pages, that should be reduced for each zone, will be
@@ -261,106 +358,198 @@ void tune_lmk_param(int *other_free, int *other_file, struct shrink_control *sc,
 }
 #endif
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * A killed task only frees its memory once every thread has been scheduled
+ * and gone through exit_mm(), which can take a long time when the system
+ * is already thrashing. The reaper unmaps the victim's private memory right
+ * away instead, the same way MADV_DONTNEED would, so the pages come back
+ * even while the victim is still stuck somewhere on its way out.
+ */
+#define LOWMEM_REAP_QUEUE	8
+#define LOWMEM_REAP_RETRIES	10
+
+static struct task_struct *lowmem_reaper_task;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_reap_wait);
+static DEFINE_SPINLOCK(lowmem_reap_lock);
+static struct mm_struct *lowmem_reap_queue[LOWMEM_REAP_QUEUE];
+static unsigned int lowmem_reap_head;
+static unsigned int lowmem_reap_tail;
+
+static void lowmem_queue_reap(struct task_struct *tsk)
 {
-	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int minfree = 0;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free;
-	int other_file;
-#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
-	int high_zoneidx = gfp_zone(sc->gfp_mask);
-	int zone_adj;
-	struct zone_avail zall[MAX_NUMNODES][MAX_NR_ZONES];
-#endif
-	unsigned long nr_to_scan = sc->nr_to_scan;
+	struct task_struct *p;
+	struct mm_struct *mm;
+	bool queued = false;
 
-	rcu_read_lock();
-	tsk = current->group_leader;
-	if ((tsk->flags & PF_EXITING) && test_task_flag(tsk, TIF_MEMDIE)) {
-		set_tsk_thread_flag(current, TIF_MEMDIE);
-		rcu_read_unlock();
-		return 0;
+	p = find_lock_task_mm(tsk);
+	if (!p)
+		return;
+
+	/*
+	 * Leave the mm alone if anything outside the dying thread group
+	 * still uses it, e.g. the parent of a vfork()ed victim.
+	 */
+	mm = p->mm;
+	if (atomic_read(&mm->mm_users) > get_nr_threads(tsk)) {
+		task_unlock(p);
+		return;
 	}
-	rcu_read_unlock();
 
-	if (nr_to_scan > 0) {
-		if (mutex_lock_interruptible(&scan_mutex) < 0)
-			return 0;
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reap_tail - lowmem_reap_head < LOWMEM_REAP_QUEUE) {
+		atomic_inc(&mm->mm_count);
+		lowmem_reap_queue[lowmem_reap_tail++ % LOWMEM_REAP_QUEUE] = mm;
+		queued = true;
 	}
+	spin_unlock(&lowmem_reap_lock);
+	task_unlock(p);
 
-#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
-  other_free = global_page_state(NR_FREE_PAGES);
-#else
-  if (global_page_state(NR_FREE_PAGES) > totalreserve_pages)
-  	other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
-  else
-    other_free = 0;
-#endif
+	if (queued)
+		wake_up(&lowmem_reap_wait);
+}
 
-	if (global_page_state(NR_FILE_PAGES) >
-      global_page_state(NR_SHMEM) + total_swapcache_pages)
-		other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM) -
-						total_swapcache_pages;
-	else
-		other_file = 0;
+static struct mm_struct *lowmem_dequeue_reap(void)
+{
+	struct mm_struct *mm = NULL;
 
-#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
-	memset(zall, 0, sizeof(zall));
-	tune_lmk_param(&other_free, &other_file, sc, zall);
-#endif
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reap_head != lowmem_reap_tail)
+		mm = lowmem_reap_queue[lowmem_reap_head++ % LOWMEM_REAP_QUEUE];
+	spin_unlock(&lowmem_reap_lock);
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
+	return mm;
+}
 
-#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
-		zone_adj = lowmem_zone_adj(i, high_zoneidx);
-		minfree = lowmem_minfree[i] - zone_adj;
-#else
-		minfree = lowmem_minfree[i];
-#endif
+static bool lowmem_reap_pending(void)
+{
+	return lowmem_reap_head != lowmem_reap_tail;
+}
 
-		if (other_free < minfree && other_file < minfree) {
-			min_score_adj = lowmem_adj[i];
-			break;
+static void lowmem_reap_mm(struct mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+	unsigned long rss;
+	int retries = LOWMEM_REAP_RETRIES;
+
+	/* exit_mmap() already ran or is running, nothing left to do */
+	if (!atomic_inc_not_zero(&mm->mm_users))
+		return;
+
+	/* the victim may be holding mmap_sem for write while it dies */
+	while (!down_read_trylock(&mm->mmap_sem)) {
+		if (!--retries) {
+			lowmem_print(2, "reaper: gave up on busy mm\n");
+			mmput(mm);
+			return;
 		}
+		msleep_interruptible(100);
 	}
-	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     nr_to_scan, sc->gfp_mask, rem);
 
-		if (nr_to_scan > 0)
-			mutex_unlock(&scan_mutex);
+	rss = get_mm_rss(mm);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_flags & (VM_LOCKED | VM_HUGETLB | VM_PFNMAP |
+				     VM_IO))
+			continue;
+		/* shared file pages are not ours to drop */
+		if (vma->vm_file && (vma->vm_flags & VM_SHARED))
+			continue;
+		zap_page_range(vma, vma->vm_start, vma->vm_end - vma->vm_start,
+			       NULL);
+	}
+	lowmem_print(2, "reaper: freed %lukB, %lukB still mapped\n",
+		     (rss - get_mm_rss(mm)) * (PAGE_SIZE / 1024),
+		     get_mm_rss(mm) * (PAGE_SIZE / 1024));
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+
+	/* the memory is back, no need to hold off the next kill */
+	lowmem_deathpending_timeout = jiffies - 1;
+}
 
-		return rem;
+static int lowmem_reaper(void *unused)
+{
+	struct mm_struct *mm;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_reap_wait,
+					 lowmem_reap_pending() ||
+					 kthread_should_stop());
+		while ((mm = lowmem_dequeue_reap())) {
+			lowmem_reap_mm(mm);
+			mmdrop(mm);
+		}
 	}
+
+	return 0;
+}
+
+/*
+ * While plenty of swap is free, reclaim can still push anonymous pages out
+ * and a kill is premature. With swap_aware set, each minfree threshold is
+ * scaled from half to all of its value as swap fills up.
+ */
+static int lowmem_swap_minfree(int minfree)
+{
+	long used;
+
+	if (!lowmem_swap_aware || total_swap_pages <= 0)
+		return minfree;
+
+	used = total_swap_pages - nr_swap_pages;
+	return minfree / 2 +
+		div_u64((u64)minfree * used, total_swap_pages) / 2;
+}
+
+/*
+ * Kill the thread group with the highest oom_score_adj at or above
+ * @min_score_adj, the largest one if several share that adj. Returns the
+ * victim's size in pages, 0 if nothing could be picked, or -EBUSY if an
+ * earlier victim is still dying. Called with scan_mutex held.
+ */
+static int lowmem_kill_victim(int min_score_adj, int minfree,
+			      int other_free, int other_file)
+{
+	struct task_struct *tsk;
+	struct task_struct *selected = NULL;
+	int tasksize;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj;
+	struct task_struct *p;
+	int oom_score_adj;
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	struct rb_node *node;
+	struct signal_struct *sig;
+	unsigned long flags;
+#endif
+#ifdef CONFIG_ZRAM
+	unsigned long swapents;
+	unsigned long swapped = total_swap_pages - nr_swap_pages;
+	unsigned long zram_pages = global_page_state(NR_ZRAM_PAGES);
+#endif
+
 	selected_oom_score_adj = min_score_adj;
 
 	rcu_read_lock();
 
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	for (node = rb_last(&lowmem_adj_root); node; node = rb_prev(node)) {
+		sig = rb_entry(node, struct signal_struct, adj_node);
+		/*
+		 * The walk runs from the highest adj down, so nothing past
+		 * this point can be picked over what we already have.
+		 */
+		if (sig->adj_key < min_score_adj)
+			break;
+		if (selected && sig->adj_key < selected_oom_score_adj)
+			break;
 
+		tsk = pid_task(sig->leader_pid, PIDTYPE_PID);
+		if (!tsk)
+			continue;
+#else
+	for_each_process(tsk) {
+#endif
 		if (tsk->flags & PF_KTHREAD)
 			continue;
 
@@ -370,6 +559,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 
 		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 			if (test_task_flag(tsk, TIF_MEMDIE)) {
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+				spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+#endif
 				rcu_read_unlock();
 				/* give the system time to free up the memory */
 				if (!same_thread_group(current, tsk))
@@ -377,8 +569,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 				else
 					set_tsk_thread_flag(current,
 								TIF_MEMDIE);
-				mutex_unlock(&scan_mutex);
-				return 0;
+				return -EBUSY;
 			}
 		}
 
@@ -400,7 +591,16 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		}
 		tasksize = get_mm_rss(p->mm);
 #ifdef CONFIG_ZRAM
-		tasksize += get_mm_counter(p->mm, MM_SWAPENTS);
+		/*
+		 * Swapped-out pages only hold what zram needs to keep them
+		 * compressed, so weight them by the size of its pools over
+		 * the swap in use. This assumes swap is zram; without any
+		 * compression gain the entries count in full.
+		 */
+		swapents = get_mm_counter(p->mm, MM_SWAPENTS);
+		if (zram_pages < swapped)
+			swapents = div_u64((u64)swapents * zram_pages, swapped);
+		tasksize += swapents;
 #endif
 		task_unlock(p);
 		if (tasksize <= 0)
@@ -418,6 +618,9 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
 			     p->pid, p->comm, oom_score_adj, tasksize);
 	}
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+#endif
 	if (selected) {
 		lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
 				"   to free %ldkB on behalf of '%s' (%d) because\n" \
@@ -433,12 +636,114 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
-		rcu_read_unlock();
-		/* give the system time to free up the memory */
+		if (lowmem_reap && lowmem_reaper_task)
+			lowmem_queue_reap(selected);
+	}
+	rcu_read_unlock();
+	/* give the system time to free up the memory */
+	if (selected)
 		msleep_interruptible(20);
-	} else
+
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct task_struct *tsk;
+	int rem = 0;
+	int i;
+	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int minfree = 0;
+	int selected_tasksize;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int other_free;
+	int other_file;
+#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
+	int high_zoneidx = gfp_zone(sc->gfp_mask);
+	int zone_adj;
+	struct zone_avail zall[MAX_NUMNODES][MAX_NR_ZONES];
+#endif
+	unsigned long nr_to_scan = sc->nr_to_scan;
+
+	rcu_read_lock();
+	tsk = current->group_leader;
+	if ((tsk->flags & PF_EXITING) && test_task_flag(tsk, TIF_MEMDIE)) {
+		set_tsk_thread_flag(current, TIF_MEMDIE);
 		rcu_read_unlock();
+		return 0;
+	}
+	rcu_read_unlock();
+
+	if (nr_to_scan > 0) {
+		if (mutex_lock_interruptible(&scan_mutex) < 0)
+			return 0;
+	}
+
+#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
+  other_free = global_page_state(NR_FREE_PAGES);
+#else
+  if (global_page_state(NR_FREE_PAGES) > totalreserve_pages)
+  	other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
+  else
+    other_free = 0;
+#endif
+
+	if (global_page_state(NR_FILE_PAGES) >
+      global_page_state(NR_SHMEM) + total_swapcache_pages)
+		other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM) -
+						total_swapcache_pages;
+	else
+		other_file = 0;
+
+#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
+	memset(zall, 0, sizeof(zall));
+	tune_lmk_param(&other_free, &other_file, sc, zall);
+#endif
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+
+#ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
+		zone_adj = lowmem_zone_adj(i, high_zoneidx);
+		minfree = lowmem_minfree[i] - zone_adj;
+#else
+		minfree = lowmem_minfree[i];
+#endif
+		minfree = lowmem_swap_minfree(minfree);
+
+		if (other_free < minfree && other_file < minfree) {
+			min_score_adj = lowmem_adj[i];
+			break;
+		}
+	}
+	if (nr_to_scan > 0)
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
+				nr_to_scan, sc->gfp_mask, other_free,
+				other_file, min_score_adj);
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+	if (nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
+			     nr_to_scan, sc->gfp_mask, rem);
+
+		if (nr_to_scan > 0)
+			mutex_unlock(&scan_mutex);
+
+		return rem;
+	}
+	selected_tasksize = lowmem_kill_victim(min_score_adj, minfree,
+					       other_free, other_file);
+	if (selected_tasksize < 0) {
+		mutex_unlock(&scan_mutex);
+		return 0;
+	}
+	rem -= selected_tasksize;
 
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     nr_to_scan, sc->gfp_mask, rem);
@@ -451,9 +756,76 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+/*
+ * Critical vmpressure means reclaim is scanning far more than it gets back,
+ * often well before free memory drops under the minfree thresholds because
+ * kswapd keeps refilling it from a shrinking page cache. In that state only
+ * the file cache is checked against minfree, and the kill happens from the
+ * vmpressure work instead of waiting for the shrinker to get called with
+ * free memory already exhausted.
+ */
+static int lowmem_vmpressure_notifier(struct notifier_block *nb,
+				      unsigned long pressure, void *data)
+{
+	int i;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int minfree = 0;
+	int other_free;
+	int other_file;
+
+	if (!lowmem_vmpressure_kill || pressure < lowmem_vmpressure_level)
+		return NOTIFY_DONE;
+
+	/* the shrinker is already on it */
+	if (!mutex_trylock(&scan_mutex))
+		return NOTIFY_DONE;
+
+	other_free = global_page_state(NR_FREE_PAGES);
+	if (global_page_state(NR_FILE_PAGES) >
+	    global_page_state(NR_SHMEM) + total_swapcache_pages)
+		other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM) -
+						total_swapcache_pages;
+	else
+		other_file = 0;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		minfree = lowmem_swap_minfree(lowmem_minfree[i]);
+		if (other_file < minfree) {
+			min_score_adj = lowmem_adj[i];
+			break;
+		}
+	}
+
+	lowmem_print(3, "lowmem_vmpressure %lu, ofree %d %d, ma %d\n",
+		     pressure, other_free, other_file, min_score_adj);
+	if (min_score_adj != OOM_SCORE_ADJ_MAX + 1)
+		lowmem_kill_victim(min_score_adj, minfree, other_free,
+				   other_file);
+
+	mutex_unlock(&scan_mutex);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notifier,
+};
+
 static int __init lowmem_init(void)
 {
 	register_shrinker(&lowmem_shrinker);
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
+
+	lowmem_reaper_task = kthread_run(lowmem_reaper, NULL, "lmk_reaper");
+	if (IS_ERR(lowmem_reaper_task)) {
+		pr_err("lowmemorykiller: failed to start reaper\n");
+		lowmem_reaper_task = NULL;
+	}
 
 #ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
 	lowmem_zone_adj_init();
@@ -464,7 +836,10 @@ static int __init lowmem_init(void)
 
 static void __exit lowmem_exit(void)
 {
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
 	unregister_shrinker(&lowmem_shrinker);
+	if (lowmem_reaper_task)
+		kthread_stop(lowmem_reaper_task);
 }
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
@@ -560,6 +935,12 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(reap, lowmem_reap, bool, S_IRUGO | S_IWUSR);
+module_param_named(swap_aware, lowmem_swap_aware, bool, S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_kill, lowmem_vmpressure_kill, bool,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_level, lowmem_vmpressure_level, uint,
+		   S_IRUGO | S_IWUSR);
 
 #ifdef CONFIG_ANDROID_LMK_PARAM_AUTO_TUNE
 module_param_named(lmk_fast_run, lmk_fast_run, int, S_IRUGO | S_IWUSR);
@@ -1059,6 +1059,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_adj_tree_update(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1188,6 +1190,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_adj_tree_update(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
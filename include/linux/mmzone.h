@@ -106,6 +106,9 @@ enum zone_stat_item {
 	NR_SHMEM,		/* shmem pages (included tmpfs/GEM pages) */
 	NR_DIRTIED,		/* page dirtyings since bootup */
 	NR_WRITTEN,		/* page writings since bootup */
+	NR_ZRAM_PAGES,		/* pages backing zram's zsmalloc pools */
+	WORKINGSET_REFAULT,	/* evicted pages faulted back in */
+	WORKINGSET_ACTIVATE,	/* ...and activated as working set */
 #ifdef CONFIG_NUMA
 	NUMA_HIT,		/* allocated in intended node */
 	NUMA_MISS,		/* allocated in non intended node */
@@ -348,6 +351,9 @@ struct zone {
 	 */
 	unsigned int		compact_considered;
 	unsigned int		compact_defer_shift;
+	/* The same for kcompactd, kept apart from direct compaction */
+	unsigned int		kcompactd_considered;
+	unsigned int		kcompactd_defer_shift;
 #endif
 
 	ZONE_PADDING(_pad1_)
@@ -372,6 +378,8 @@ struct zone {
 	 */
 	unsigned int inactive_ratio;
 
+	/* Evictions & activations on the inactive lists, see workingset.c */
+	atomic_long_t		inactive_age;
 
 	ZONE_PADDING(_pad2_)
 	/* Rarely used or read-mostly fields */
@@ -650,6 +658,12 @@ typedef struct pglist_data {
 	struct task_struct *kswapd;	/* Protected by lock_memory_hotplug() */
 	int kswapd_max_order;
 	enum zone_type classzone_idx;
+#ifdef CONFIG_COMPACTION
+	int kcompactd_max_order;
+	enum zone_type kcompactd_classzone_idx;
+	wait_queue_head_t kcompactd_wait;
+	struct task_struct *kcompactd;	/* Protected by lock_memory_hotplug() */
+#endif
 } pg_data_t;
 
 #define node_present_pages(nid)	(NODE_DATA(nid)->node_present_pages)
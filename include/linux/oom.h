@@ -42,6 +42,24 @@ enum oom_constraint {
 
 extern int test_set_oom_score_adj(int new_val);
 
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+extern void lowmem_adj_tree_add(struct task_struct *p);
+extern void lowmem_adj_tree_del(struct task_struct *p);
+extern void lowmem_adj_tree_update(struct task_struct *p);
+#else
+static inline void lowmem_adj_tree_add(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_tree_del(struct task_struct *p)
+{
+}
+
+static inline void lowmem_adj_tree_update(struct task_struct *p)
+{
+}
+#endif
+
 extern unsigned int oom_badness(struct task_struct *p, struct mem_cgroup *mem,
 			const nodemask_t *nodemask, unsigned long totalpages);
 extern int try_set_zonelist_oom(struct zonelist *zonelist, gfp_t gfp_flags);
@@ -652,7 +652,8 @@ struct signal_struct {
 	short oom_score_adj_min;/* OOM kill score adjustment min value.
 				 * Only settable by CAP_SYS_RESOURCE. */
 #ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-	struct rb_node adj_node;
+	struct rb_node adj_node;	/* lowmemorykiller index, by adj_key */
+	short adj_key;			/* oom_score_adj when last indexed */
 #endif
 	struct mutex cred_guard_mutex;	/* guard against foreign influences on
 					 * credential calculations
@@ -181,6 +181,8 @@ repeat:
 	write_lock_irq(&tasklist_lock);
 	tracehook_finish_release_task(p);
 	__exit_signal(p);
+	if (thread_group_leader(p))
+		lowmem_adj_tree_del(p);
 
 	/*
 	 * If we are the last non-leader member of the thread
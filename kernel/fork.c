@@ -1391,6 +1391,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 
 	total_forks++;
 	spin_unlock(&current->sighand->siglock);
+	if (likely(p->pid) && thread_group_leader(p))
+		lowmem_adj_tree_add(p);
 	write_unlock_irq(&tasklist_lock);
 	proc_fork_connector(p);
 	cgroup_post_fork(p);
@@ -14,6 +14,8 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 #include "internal.h"
 
 #define CREATE_TRACE_POINTS
@@ -36,6 +38,7 @@ struct compact_control {
 	bool sync;			/* Synchronous migration */
 
 	unsigned int order;		/* order a direct compactor needs */
+	unsigned long nr_blocks;	/* free blocks of order kcompactd keeps */
 	int migratetype;		/* MOVABLE, RECLAIMABLE etc */
 	struct zone *zone;
 };
@@ -447,6 +450,18 @@ static void update_nr_listpages(struct compact_control *cc)
 	cc->nr_freepages = nr_freepages;
 }
 
+/* Number of free blocks of at least @order pages, in units of @order */
+static unsigned long zone_free_blocks(struct zone *zone, unsigned int order)
+{
+	unsigned long nr_blocks = 0;
+	unsigned int o;
+
+	for (o = order; o < MAX_ORDER; o++)
+		nr_blocks += zone->free_area[o].nr_free << (o - order);
+
+	return nr_blocks;
+}
+
 static int compact_finished(struct zone *zone,
 			    struct compact_control *cc)
 {
@@ -467,6 +482,13 @@ static int compact_finished(struct zone *zone,
 	if (cc->order == -1)
 		return COMPACT_CONTINUE;
 
+	/* kcompactd keeping a reserve: done once it is built up */
+	if (cc->nr_blocks) {
+		if (zone_free_blocks(zone, cc->order) >= cc->nr_blocks)
+			return COMPACT_PARTIAL;
+		return COMPACT_CONTINUE;
+	}
+
 	/* Compaction run is not finished if the watermark is not met */
 	watermark = low_wmark_pages(zone);
 	watermark += (1 << cc->order);
@@ -542,15 +564,18 @@ static int compact_zone(struct zone *zone, struct compact_control *cc)
 {
 	int ret;
 
-	ret = compaction_suitable(zone, cc->order);
-	switch (ret) {
-	case COMPACT_PARTIAL:
-	case COMPACT_SKIPPED:
-		/* Compaction is likely to fail */
-		return ret;
-	case COMPACT_CONTINUE:
-		/* Fall through to compaction */
-		;
+	/* kcompactd checks its reserve against its own thresholds */
+	if (!cc->nr_blocks) {
+		ret = compaction_suitable(zone, cc->order);
+		switch (ret) {
+		case COMPACT_PARTIAL:
+		case COMPACT_SKIPPED:
+			/* Compaction is likely to fail */
+			return ret;
+		case COMPACT_CONTINUE:
+			/* Fall through to compaction */
+			;
+		}
 	}
 
 	/* Setup to move all movable pages to the end of the zone */
@@ -743,6 +768,328 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * kcompactd keeps sysctl_kcompactd_free_blocks free blocks of
+ * sysctl_kcompactd_order pages in every zone, checked every
+ * KCOMPACTD_INTERVAL.  A reserve of 0 leaves it to compact only when
+ * kswapd has balanced a node for a high-order allocation.
+ */
+int sysctl_kcompactd_order = PAGE_ALLOC_COSTLY_ORDER;
+int sysctl_kcompactd_free_blocks;
+
+#define KCOMPACTD_INTERVAL	(HZ / 2)
+
+int sysctl_kcompactd_handler(struct ctl_table *table, int write,
+			void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int ret, nid;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (ret || !write)
+		return ret;
+
+	/* a sleeping kcompactd may not be polling the reserve yet */
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		wake_up_interruptible(&NODE_DATA(nid)->kcompactd_wait);
+
+	return 0;
+}
+
+/*
+ * Is the zone short of its reserve of free blocks, for lack of
+ * contiguity rather than of memory?
+ */
+static bool kcompactd_zone_short(struct zone *zone, int order,
+				 unsigned long nr_blocks)
+{
+	unsigned long watermark;
+	int fragindex;
+
+	if (zone_free_blocks(zone, order) >= nr_blocks)
+		return false;
+
+	/*
+	 * There must be enough free memory for the whole reserve, plus
+	 * room for the copies migration makes, as in compaction_suitable.
+	 */
+	watermark = low_wmark_pages(zone) + (nr_blocks << order) +
+		(2UL << order);
+	if (!zone_watermark_ok(zone, 0, watermark, 0, 0))
+		return false;
+
+	/* -1000 means blocks of this order exist, just not enough of them */
+	fragindex = fragmentation_index(zone, order);
+	if (fragindex >= 0 && fragindex <= sysctl_extfrag_threshold)
+		return false;
+
+	return true;
+}
+
+static bool kcompactd_zone_done(struct zone *zone, int order,
+				unsigned long nr_blocks)
+{
+	if (nr_blocks)
+		return zone_free_blocks(zone, order) >= nr_blocks;
+
+	return zone_watermark_ok(zone, order, low_wmark_pages(zone), 0, 0);
+}
+
+/*
+ * kcompactd backs off like direct compaction does, see defer_compaction(),
+ * but on its own: a failed background pass for one order must not make
+ * direct compaction skip the zone for every order.
+ */
+static void kcompactd_defer(struct zone *zone)
+{
+	zone->kcompactd_considered = 0;
+	if (zone->kcompactd_defer_shift < COMPACT_MAX_DEFER_SHIFT)
+		zone->kcompactd_defer_shift++;
+}
+
+static bool kcompactd_deferred(struct zone *zone)
+{
+	unsigned long defer_limit = 1UL << zone->kcompactd_defer_shift;
+
+	if (++zone->kcompactd_considered > defer_limit)
+		zone->kcompactd_considered = defer_limit;
+
+	return zone->kcompactd_considered < defer_limit;
+}
+
+static void kcompactd_compact_zone(struct zone *zone, int order,
+				   unsigned long nr_blocks)
+{
+	struct compact_control cc = {
+		.nr_freepages = 0,
+		.nr_migratepages = 0,
+		.order = order,
+		.nr_blocks = nr_blocks,
+		.migratetype = MIGRATE_MOVABLE,
+		.zone = zone,
+		.sync = true,
+	};
+	int status;
+
+	INIT_LIST_HEAD(&cc.freepages);
+	INIT_LIST_HEAD(&cc.migratepages);
+
+	count_vm_event(KCOMPACTD_WAKE);
+	status = compact_zone(zone, &cc);
+
+	VM_BUG_ON(!list_empty(&cc.freepages));
+	VM_BUG_ON(!list_empty(&cc.migratepages));
+
+	if (kcompactd_zone_done(zone, order, nr_blocks)) {
+		zone->kcompactd_considered = 0;
+		zone->kcompactd_defer_shift = 0;
+		count_vm_event(KCOMPACTD_SUCCESS);
+	} else if (status == COMPACT_COMPLETE) {
+		/* the whole zone was scanned in vain, back off */
+		kcompactd_defer(zone);
+		count_vm_event(KCOMPACTD_FAIL);
+	}
+}
+
+static bool kcompactd_node_suitable(pg_data_t *pgdat)
+{
+	int zoneid;
+	struct zone *zone;
+
+	for (zoneid = 0; zoneid <= pgdat->kcompactd_classzone_idx; zoneid++) {
+		zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (compaction_suitable(zone, pgdat->kcompactd_max_order) ==
+							COMPACT_CONTINUE)
+			return true;
+	}
+
+	return false;
+}
+
+/* Compact for the high-order request kswapd reclaimed for */
+static void kcompactd_do_work(pg_data_t *pgdat)
+{
+	int order = pgdat->kcompactd_max_order;
+	int classzone_idx = pgdat->kcompactd_classzone_idx;
+	int zoneid;
+	struct zone *zone;
+
+	pgdat->kcompactd_max_order = 0;
+	pgdat->kcompactd_classzone_idx = pgdat->nr_zones - 1;
+
+	for (zoneid = 0; zoneid <= classzone_idx; zoneid++) {
+		zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (kcompactd_deferred(zone))
+			continue;
+
+		if (compaction_suitable(zone, order) != COMPACT_CONTINUE)
+			continue;
+
+		kcompactd_compact_zone(zone, order, 0);
+
+		if (kthread_should_stop())
+			return;
+	}
+}
+
+/* Top up every zone's reserve of free high-order blocks */
+static void kcompactd_do_reserve(pg_data_t *pgdat)
+{
+	int order = sysctl_kcompactd_order;
+	unsigned long nr_blocks = sysctl_kcompactd_free_blocks;
+	int zoneid;
+	struct zone *zone;
+
+	if (!nr_blocks)
+		return;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (!kcompactd_zone_short(zone, order, nr_blocks))
+			continue;
+
+		if (kcompactd_deferred(zone))
+			continue;
+
+		kcompactd_compact_zone(zone, order, nr_blocks);
+
+		if (kthread_should_stop())
+			return;
+	}
+}
+
+/**
+ * wakeup_kcompactd - ask kcompactd to compact a node for an allocation
+ * @pgdat: the node
+ * @order: order of the allocation
+ * @classzone_idx: highest zone the allocation may use
+ *
+ * Called by kswapd once it has balanced @pgdat for an allocation of
+ * @order, so the blocks are put together before anybody stalls in
+ * direct compaction.
+ */
+void wakeup_kcompactd(pg_data_t *pgdat, int order, int classzone_idx)
+{
+	if (!order)
+		return;
+
+	if (pgdat->kcompactd_max_order < order)
+		pgdat->kcompactd_max_order = order;
+
+	if (pgdat->kcompactd_classzone_idx > classzone_idx)
+		pgdat->kcompactd_classzone_idx = classzone_idx;
+
+	if (!waitqueue_active(&pgdat->kcompactd_wait))
+		return;
+
+	if (!kcompactd_node_suitable(pgdat))
+		return;
+
+	wake_up_interruptible(&pgdat->kcompactd_wait);
+}
+
+static bool kcompactd_work_requested(pg_data_t *pgdat, bool polling)
+{
+	/* a reserve set up while kcompactd slept needs it to start polling */
+	if (!polling && sysctl_kcompactd_free_blocks)
+		return true;
+
+	return pgdat->kcompactd_max_order > 0 || kthread_should_stop();
+}
+
+/*
+ * The background compaction daemon, started as a kernel thread
+ * from the init process.
+ */
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	struct task_struct *tsk = current;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	bool polling;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(tsk, cpumask);
+
+	set_freezable();
+
+	pgdat->kcompactd_max_order = 0;
+	pgdat->kcompactd_classzone_idx = pgdat->nr_zones - 1;
+
+	while (!kthread_should_stop()) {
+		polling = sysctl_kcompactd_free_blocks != 0;
+		wait_event_freezable_timeout(pgdat->kcompactd_wait,
+				kcompactd_work_requested(pgdat, polling),
+				polling ? KCOMPACTD_INTERVAL : MAX_SCHEDULE_TIMEOUT);
+		if (kthread_should_stop())
+			break;
+
+		/* Flush pending updates to the LRU lists */
+		lru_add_drain();
+
+		if (pgdat->kcompactd_max_order)
+			kcompactd_do_work(pgdat);
+		kcompactd_do_reserve(pgdat);
+	}
+
+	return 0;
+}
+
+/*
+ * This kcompactd start function will be called by init and node-hot-add.
+ */
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	pgdat->kcompactd = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(pgdat->kcompactd)) {
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		ret = PTR_ERR(pgdat->kcompactd);
+		pgdat->kcompactd = NULL;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.  Caller
+ * must hold lock_memory_hotplug().
+ */
+void kcompactd_stop(int nid)
+{
+	struct task_struct *kcompactd = NODE_DATA(nid)->kcompactd;
+
+	if (kcompactd) {
+		kthread_stop(kcompactd);
+		NODE_DATA(nid)->kcompactd = NULL;
+	}
+}
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+	return 0;
+}
+module_init(kcompactd_init)
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 ssize_t sysfs_compact_node(struct sys_device *dev,
 			struct sysdev_attribute *attr,
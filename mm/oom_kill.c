@@ -55,6 +55,7 @@ int test_set_oom_score_adj(int new_val)
 	old_val = current->signal->oom_score_adj;
 	current->signal->oom_score_adj = new_val;
 	spin_unlock_irq(&sighand->siglock);
+	lowmem_adj_tree_update(current);
 
 	return old_val;
 }
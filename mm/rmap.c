@@ -1231,6 +1231,16 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else if (PageAnon(page)) {
 		swp_entry_t entry = { .val = page_private(page) };
 
+		/*
+		 * Not written to since MADV_FREE, through this pte or one
+		 * unmapped before: nobody needs the contents, so leave the
+		 * pte empty rather than point it at swap.
+		 */
+		if (!PageDirty(page) && (flags & TTU_LZFREE)) {
+			dec_mm_counter(mm, MM_ANONPAGES);
+			goto discard;
+		}
+
 		if (PageSwapCache(page)) {
 			/*
 			 * Store the swap location in the pte.
@@ -1268,6 +1278,7 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else
 		dec_mm_counter(mm, MM_FILEPAGES);
 
+discard:
 	page_remove_rmap(page);
 	page_cache_release(page);
 
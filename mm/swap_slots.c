@@ -0,0 +1,201 @@
+/*
+ *  linux/mm/swap_slots.c
+ *
+ *  Per-cpu caches of swap slots.
+ *
+ *  Allocating and freeing a swap slot both go through the global
+ *  swap_lock.  With a fast swap device like zram, reclaim on several
+ *  CPUs then spends its time contending on that lock rather than
+ *  swapping.  So each CPU keeps a small cache of slots allocated in one
+ *  batch, and collects slots whose last reference went away, to free
+ *  them in one batch later.
+ *
+ *  A slot in either cache is marked SWAP_HAS_CACHE in the swap map, with
+ *  no page in the swap cache and no other reference.  Nobody but
+ *  readahead looks at such a slot, see read_swap_cache_async().
+ *
+ *  swapoff must not find any slots of its device in the caches, so it
+ *  disables them, draining every CPU's cache, for the duration.
+ */
+
+#include <linux/swap.h>
+#include <linux/cpu.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/init.h>
+
+#define SWAP_SLOTS_CACHE_SIZE	64
+
+struct swap_slots_cache {
+	struct mutex	alloc_lock;	/* protects slots, cur and nr */
+	swp_entry_t	slots[SWAP_SLOTS_CACHE_SIZE];
+	int		cur;
+	int		nr;
+	spinlock_t	free_lock;	/* protects slots_ret and n_ret */
+	swp_entry_t	slots_ret[SWAP_SLOTS_CACHE_SIZE];
+	int		n_ret;
+};
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swp_slots);
+
+/* Serialises enabling and disabling the caches */
+static DEFINE_MUTEX(swap_slots_cache_mutex);
+/* Disabled until initialised, and while any swapoff is in progress */
+static int swap_slots_cache_disabled = 1;
+bool swap_slot_cache_enabled __read_mostly;
+
+/*
+ * Refilling a cache takes slots away from everybody else, so only do
+ * it while there is plenty of swap space left.
+ */
+static bool swap_slot_cache_refillable(void)
+{
+	return swap_slot_cache_enabled &&
+		nr_swap_pages > num_online_cpus() * SWAP_SLOTS_CACHE_SIZE * 2;
+}
+
+static void drain_slots_cache_cpu(unsigned int cpu)
+{
+	struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+	mutex_lock(&cache->alloc_lock);
+	if (cache->nr) {
+		swapcache_free_entries(cache->slots + cache->cur, cache->nr);
+		cache->cur = 0;
+		cache->nr = 0;
+	}
+	mutex_unlock(&cache->alloc_lock);
+
+	spin_lock(&cache->free_lock);
+	if (cache->n_ret) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	spin_unlock(&cache->free_lock);
+}
+
+/**
+ * disable_swap_slots_cache - stop caching swap slots
+ *
+ * Empties every CPU's caches, returning their slots to the swap map,
+ * and keeps them empty until enable_swap_slots_cache().  Calls nest.
+ */
+void disable_swap_slots_cache(void)
+{
+	unsigned int cpu;
+
+	mutex_lock(&swap_slots_cache_mutex);
+	swap_slots_cache_disabled++;
+	swap_slot_cache_enabled = false;
+	/*
+	 * Anybody filling a cache after this has taken its lock after we
+	 * drained it, and so sees the caches disabled.
+	 */
+	for_each_possible_cpu(cpu)
+		drain_slots_cache_cpu(cpu);
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+/**
+ * enable_swap_slots_cache - undo disable_swap_slots_cache()
+ */
+void enable_swap_slots_cache(void)
+{
+	mutex_lock(&swap_slots_cache_mutex);
+	if (!--swap_slots_cache_disabled)
+		swap_slot_cache_enabled = true;
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+/**
+ * free_swap_slot - free a swap slot later, together with others
+ * @entry: the slot, referenced by nothing but SWAP_HAS_CACHE
+ *
+ * Returns false if the caches are disabled, and the caller has to
+ * free the slot itself.
+ */
+bool free_swap_slot(swp_entry_t entry)
+{
+	struct swap_slots_cache *cache;
+	bool ret = false;
+
+	if (!swap_slot_cache_enabled)
+		return false;
+
+	cache = &per_cpu(swp_slots, raw_smp_processor_id());
+	spin_lock(&cache->free_lock);
+	/* recheck, we may have raced with disable_swap_slots_cache() */
+	if (!swap_slot_cache_enabled)
+		goto out;
+	if (cache->n_ret >= SWAP_SLOTS_CACHE_SIZE) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	cache->slots_ret[cache->n_ret++] = entry;
+	ret = true;
+out:
+	spin_unlock(&cache->free_lock);
+	return ret;
+}
+
+/**
+ * get_swap_page - allocate a swap slot for a page going to swap cache
+ *
+ * Takes the slot from this CPU's cache, refilling it first when empty.
+ * Returns an entry with val 0 if swap is full.
+ */
+swp_entry_t get_swap_page(void)
+{
+	struct swap_slots_cache *cache;
+	swp_entry_t entry;
+
+	if (swap_slot_cache_enabled) {
+		/*
+		 * We may be migrated to another CPU while we hold the lock,
+		 * which costs nothing but a little locality.
+		 */
+		cache = &per_cpu(swp_slots, raw_smp_processor_id());
+		mutex_lock(&cache->alloc_lock);
+		if (!cache->nr && swap_slot_cache_refillable()) {
+			cache->cur = 0;
+			cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE,
+						   cache->slots);
+		}
+		if (cache->nr) {
+			entry = cache->slots[cache->cur++];
+			cache->nr--;
+			mutex_unlock(&cache->alloc_lock);
+			return entry;
+		}
+		mutex_unlock(&cache->alloc_lock);
+	}
+
+	if (!get_swap_pages(1, &entry))
+		entry.val = 0;
+	return entry;
+}
+
+static int __cpuinit swap_slots_cpu_callback(struct notifier_block *nfb,
+					     unsigned long action, void *hcpu)
+{
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN)
+		drain_slots_cache_cpu((long)hcpu);
+	return NOTIFY_OK;
+}
+
+static int __init swap_slots_init(void)
+{
+	struct swap_slots_cache *cache;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = &per_cpu(swp_slots, cpu);
+		mutex_init(&cache->alloc_lock);
+		spin_lock_init(&cache->free_lock);
+	}
+	hotcpu_notifier(swap_slots_cpu_callback, 0);
+	enable_swap_slots_cache();
+	return 0;
+}
+module_init(swap_slots_init);
@@ -169,13 +169,14 @@ int add_to_swap(struct page *page)
 	 * deadlock in the swap out path.
 	 */
 	/*
-	 * Add it to the swap cache and mark it dirty
+	 * Add it to the swap cache.  It is not marked dirty here: whether
+	 * it needs writing out is up to its ptes, so that try_to_unmap()
+	 * can discard a page not written to since MADV_FREE.
 	 */
 	err = add_to_swap_cache(page, entry,
 			__GFP_HIGH|__GFP_NOMEMALLOC|__GFP_NOWARN);
 
 	if (!err) {	/* Success */
-		SetPageDirty(page);
 		return 1;
 	} else {	/* -ENOMEM radix-tree allocation failure */
 		/*
@@ -332,6 +333,13 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 			 * scheduler here, if there are some more important
 			 * tasks to run.
 			 */
+			/*
+			 * A slot held by a per-cpu swap slot cache never gets
+			 * a page: only readahead can get here with one, and
+			 * it has no reason to wait.
+			 */
+			if (swap_slot_cache_enabled && !__swap_count(entry))
+				break;
 			cond_resched();
 			continue;
 		}
@@ -349,7 +357,10 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 			/*
 			 * Initiate read into locked page and return.
 			 */
-			lru_cache_add_anon(new_page);
+			if (workingset_refault(&swapper_space, entry.val))
+				__lru_cache_add(new_page, LRU_ACTIVE_ANON);
+			else
+				lru_cache_add_anon(new_page);
 			swap_readpage(new_page);
 			return new_page;
 		}
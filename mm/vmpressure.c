@@ -22,6 +22,7 @@
 #include <linux/swap.h>
 #include <linux/printk.h>
 #include <linux/slab.h>
+#include <linux/notifier.h>
 #include <linux/vmpressure.h>
 
 /*
@@ -113,8 +114,8 @@ static enum vmpressure_levels vmpressure_level(unsigned long pressure)
 	return VMPRESSURE_LOW;
 }
 
-static enum vmpressure_levels vmpressure_calc_level(unsigned long scanned,
-						    unsigned long reclaimed)
+static unsigned long vmpressure_calc_pressure(unsigned long scanned,
+					      unsigned long reclaimed)
 {
 	unsigned long scale = scanned + reclaimed;
 	unsigned long pressure;
@@ -132,7 +133,24 @@ static enum vmpressure_levels vmpressure_calc_level(unsigned long scanned,
 	pr_debug("%s: %3lu  (s: %lu  r: %lu)\n", __func__, pressure,
 		 scanned, reclaimed);
 
-	return vmpressure_level(pressure);
+	return pressure;
+}
+
+/*
+ * In-kernel listeners for system-wide pressure, i.e. the root cgroup. The
+ * notifier is called from the vmpressure work with the pressure index
+ * (0-100) as the action argument.
+ */
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+int vmpressure_notifier_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+
+int vmpressure_notifier_unregister(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
 }
 
 struct vmpressure_event {
@@ -146,9 +164,15 @@ static bool vmpressure_event(struct vmpressure *vmpr,
 {
 	struct vmpressure_event *ev;
 	enum vmpressure_levels level;
+	unsigned long pressure;
 	bool signalled = false;
 
-	level = vmpressure_calc_level(scanned, reclaimed);
+	pressure = vmpressure_calc_pressure(scanned, reclaimed);
+	level = vmpressure_level(pressure);
+
+	if (vmpr == memcg_to_vmpressure(NULL))
+		blocking_notifier_call_chain(&vmpressure_notifier, pressure,
+					     NULL);
 
 	mutex_lock(&vmpr->events_lock);
 
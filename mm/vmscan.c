@@ -525,9 +525,11 @@ static pageout_t pageout(struct page *page, struct address_space *mapping,
 
 /*
  * Same as remove_mapping, but if the page is removed from the mapping, it
- * gets returned with a refcount of 0.
+ * gets returned with a refcount of 0.  @reclaimed says whether this is an
+ * eviction by reclaim, to be remembered for refault detection.
  */
-static int __remove_mapping(struct address_space *mapping, struct page *page)
+static int __remove_mapping(struct address_space *mapping, struct page *page,
+			    bool reclaimed)
 {
 	BUG_ON(!PageLocked(page));
 	BUG_ON(mapping != page_mapping(page));
@@ -568,6 +570,8 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 
 	if (PageSwapCache(page)) {
 		swp_entry_t swap = { .val = page_private(page) };
+		if (reclaimed)
+			workingset_eviction(mapping, swap.val, page);
 		__delete_from_swap_cache(page);
 		spin_unlock_irq(&mapping->tree_lock);
 		swapcache_free(swap, page);
@@ -576,6 +580,8 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 
 		freepage = mapping->a_ops->freepage;
 
+		if (reclaimed)
+			workingset_eviction(mapping, page->index, page);
 		__delete_from_page_cache(page);
 		spin_unlock_irq(&mapping->tree_lock);
 		mem_cgroup_uncharge_cache_page(page);
@@ -599,7 +605,7 @@ cannot_free:
  */
 int remove_mapping(struct address_space *mapping, struct page *page)
 {
-	if (__remove_mapping(mapping, page)) {
+	if (__remove_mapping(mapping, page, false)) {
 		/*
 		 * Unfreezing the refcount with 1 rather than 2 effectively
 		 * drops the pagecache ref for us without requiring another
@@ -793,6 +799,7 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		struct address_space *mapping;
 		struct page *page;
 		int may_enter_fs;
+		bool lazyfree = false;
 
 		cond_resched();
 
@@ -852,12 +859,17 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		/*
 		 * Anonymous process memory has backing store?
 		 * Try to allocate it some swap space here.
+		 *
+		 * Its contents are only on the ptes and in PageDirty now:
+		 * a page none of whose ptes was written to since
+		 * MADV_FREE is discarded by try_to_unmap() below.
 		 */
 		if (PageAnon(page) && !PageSwapCache(page)) {
 			if (!(sc->gfp_mask & __GFP_IO))
 				goto keep_locked;
 			if (!add_to_swap(page))
 				goto activate_locked;
+			lazyfree = true;
 			may_enter_fs = 1;
 		}
 
@@ -868,7 +880,18 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		 * processes. Try to unmap it here.
 		 */
 		if (page_mapped(page) && mapping) {
-			switch (try_to_unmap(page, TTU_UNMAP)) {
+			int ret = try_to_unmap(page, lazyfree ?
+					       TTU_UNMAP | TTU_LZFREE : TTU_UNMAP);
+
+			/*
+			 * Some ptes may be gone already, but the swap slot was
+			 * never written: make sure it is before any other pte
+			 * is pointed at it.
+			 */
+			if (lazyfree && ret != SWAP_SUCCESS)
+				SetPageDirty(page);
+
+			switch (ret) {
 			case SWAP_FAIL:
 				goto activate_locked;
 			case SWAP_AGAIN:
@@ -880,6 +903,10 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			}
 		}
 
+		/* written to after all, it has to go to swap */
+		if (PageDirty(page))
+			lazyfree = false;
+
 		if (PageDirty(page)) {
 			nr_dirty++;
 
@@ -959,9 +986,12 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			}
 		}
 
-		if (!mapping || !__remove_mapping(mapping, page))
+		if (!mapping || !__remove_mapping(mapping, page, true))
 			goto keep_locked;
 
+		if (lazyfree)
+			count_vm_event(PGLAZYFREED);
+
 		/*
 		 * At this point, we have no other references and there is
 		 * no way to pick any more up (removed from LRU, removed
@@ -2893,6 +2923,14 @@ static void kswapd_try_to_sleep(pg_data_t *pgdat, int order, int classzone_idx)
 		 */
 		set_pgdat_percpu_threshold(pgdat, calculate_normal_threshold);
 
+		/*
+		 * kswapd has only reclaimed order-0 pages for a high-order
+		 * request. Now that the node is balanced, have kcompactd
+		 * turn them into a block of the requested order before an
+		 * allocation has to compact directly.
+		 */
+		wakeup_kcompactd(pgdat, order, classzone_idx);
+
 		if (!kthread_should_stop())
 			schedule();
 
@@ -0,0 +1,304 @@
+/*
+ * mm/workingset.c
+ *
+ * Workingset detection: refault distances of evicted pages
+ */
+
+#include <linux/pagemap.h>
+#include <linux/atomic.h>
+#include <linux/module.h>
+#include <linux/swap.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mm_inline.h>
+
+/*
+ *		Double CLOCK lists
+ *
+ * Per zone, two clock lists are maintained for each page type: the
+ * inactive and the active list.  Freshly faulted pages start out at
+ * the head of the inactive list and page reclaim scans pages from the
+ * tail.  Pages that are accessed multiple times on the inactive list
+ * are promoted to the active list, to protect them from reclaim,
+ * whereas active pages are demoted to the inactive list when the
+ * active list grows too big.
+ *
+ *   fault ------------------------+
+ *                                 |
+ *              +--------------+   |            +-------------+
+ *   reclaim <- |   inactive   | <-+-- demotion |    active   | <--+
+ *              +--------------+                +-------------+    |
+ *                     |                                           |
+ *                     +-------------- promotion ------------------+
+ *
+ *
+ *		Access frequency and refault distance
+ *
+ * A workload is thrashing when its pages are frequently used but they
+ * are evicted from the inactive list every time before another access
+ * would have promoted them to the active list.
+ *
+ * Consider a page that is evicted, and think of the number of pages that
+ * were evicted or activated in its zone between its eviction and its
+ * refault.  Every eviction and every activation moves the inactive list
+ * along by one page, so this number -- the refault distance -- is the
+ * minimum number of extra inactive slots the page would have needed to
+ * survive until it was accessed again.
+ *
+ * Those slots could only have come out of the active list, so a page
+ * whose refault distance is no larger than the active list is one that
+ * would have stayed resident had it been allowed to compete with the
+ * active pages.  Such a page is activated straight away on refault
+ * rather than starting over on the inactive list, where it would most
+ * likely be evicted again before its next use.
+ *
+ *
+ *		Implementation
+ *
+ * For each zone's inactive lists, a counter is maintained that is
+ * incremented on every eviction and every activation.  When a page is
+ * evicted by reclaim, a snapshot of its zone's counter is stored as a
+ * shadow entry keyed by the page's mapping and index.  When a page is
+ * added to the page cache or the swap cache, a matching shadow entry
+ * is looked up and consumed, and the distance computed from it.
+ *
+ * The shadow entries live in a fixed-size, set-associative table next to
+ * the page cache rather than in the mapping's radix tree, whose lookups
+ * all over the kernel expect nothing but pages there.  The table is
+ * sized to remember about half as many evictions as there are pages of
+ * memory, which covers every distance that could lead to an activation
+ * on the active list of one page type.  Entries are never explicitly
+ * invalidated: truncation, or a mapping being freed and its address
+ * reused, can at worst cause one spurious activation, which reclaim
+ * corrects in the normal way.  Updates are lockless and best-effort.
+ */
+
+/*
+ * A shadow entry: the hash of the page's (mapping, index) as a tag, and
+ * the eviction cookie.  A zero tag marks an empty slot.
+ */
+struct shadow_entry {
+	u32 tag;
+	u32 cookie;
+};
+
+/* one cache line's worth of entries per bucket */
+#define SHADOW_BUCKET_SIZE	8
+
+static struct shadow_entry *shadow_table __read_mostly;
+static unsigned int shadow_bucket_mask __read_mostly;
+
+/* cookie layout: eviction timestamp | file | node | zone */
+#define EVICTION_SHIFT	(1 + NODES_SHIFT + ZONES_SHIFT)
+#define EVICTION_MASK	(~0U >> EVICTION_SHIFT)
+
+/*
+ * Eviction timestamps need to be able to cover the full range of
+ * actionable refaults. However, bits are tight in the cookie, so if
+ * a zone can have more pages than 2^(32 - EVICTION_SHIFT), evictions
+ * are counted in buckets of 2^bucket_order.
+ */
+static unsigned int bucket_order __read_mostly;
+
+static u32 pack_cookie(struct zone *zone, unsigned long eviction, bool file)
+{
+	u32 cookie;
+
+	eviction >>= bucket_order;
+	cookie = (eviction << 1) | file;
+	cookie = (cookie << NODES_SHIFT) | zone_to_nid(zone);
+	cookie = (cookie << ZONES_SHIFT) | zone_idx(zone);
+
+	return cookie;
+}
+
+/* NODE_DATA() ignores its argument on !NUMA, so keep nid a parameter */
+static struct zone *cookie_zone(int nid, int zid)
+{
+	return NODE_DATA(nid)->node_zones + zid;
+}
+
+static void unpack_cookie(u32 cookie, struct zone **zone,
+			  unsigned long *eviction, bool *file)
+{
+	int zid, nid;
+
+	zid = cookie & ((1U << ZONES_SHIFT) - 1);
+	cookie >>= ZONES_SHIFT;
+	nid = cookie & ((1U << NODES_SHIFT) - 1);
+	cookie >>= NODES_SHIFT;
+	*file = cookie & 1;
+	cookie >>= 1;
+
+	*zone = cookie_zone(nid, zid);
+	*eviction = (unsigned long)cookie << bucket_order;
+}
+
+static u32 shadow_hash(struct address_space *mapping, pgoff_t index)
+{
+	u32 hash = jhash_2words(hash_ptr(mapping, 32), (u32)index, 0);
+
+	/* a zero tag means an empty slot */
+	return hash ? hash : 1;
+}
+
+static struct shadow_entry *shadow_bucket(u32 hash)
+{
+	return shadow_table + (hash & shadow_bucket_mask) * SHADOW_BUCKET_SIZE;
+}
+
+/**
+ * workingset_eviction - note the eviction of a page from memory
+ * @mapping: address space the page was backing
+ * @index: the page's index in @mapping, or its swap entry
+ * @page: the page being evicted
+ *
+ * Called by reclaim, with the page locked and @mapping->tree_lock held,
+ * right before the page is removed from the page or swap cache.
+ */
+void workingset_eviction(struct address_space *mapping, pgoff_t index,
+			 struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	struct shadow_entry *bucket, *entry, *empty = NULL;
+	unsigned long eviction;
+	u32 hash, tag;
+
+	if (!shadow_table)
+		return;
+
+	eviction = atomic_long_inc_return(&zone->inactive_age);
+	hash = shadow_hash(mapping, index);
+	bucket = shadow_bucket(hash);
+
+	/*
+	 * Overwrite an older entry for the same page, so that a refault
+	 * never finds a stale eviction, else take an empty slot, else
+	 * replace one at random.
+	 */
+	for (entry = bucket; entry < bucket + SHADOW_BUCKET_SIZE; entry++) {
+		tag = ACCESS_ONCE(entry->tag);
+		if (tag == hash)
+			break;
+		if (!tag && !empty)
+			empty = entry;
+	}
+	if (entry == bucket + SHADOW_BUCKET_SIZE)
+		entry = empty ? empty : bucket + (eviction % SHADOW_BUCKET_SIZE);
+
+	entry->tag = 0;
+	smp_wmb();
+	entry->cookie = pack_cookie(zone, eviction, page_is_file_cache(page));
+	smp_wmb();
+	entry->tag = hash;
+}
+
+/**
+ * workingset_refault - evaluate the refault of a previously evicted page
+ * @mapping: address space the page is being added to
+ * @index: the page's index in @mapping, or its swap entry
+ *
+ * Consumes the shadow entry of a page evicted from @mapping at @index,
+ * if there is one, and accounts the refault.
+ *
+ * Returns %true if the page should be activated, %false otherwise.
+ */
+bool workingset_refault(struct address_space *mapping, pgoff_t index)
+{
+	struct shadow_entry *bucket, *entry;
+	unsigned long refault_distance;
+	unsigned long eviction;
+	unsigned long refault;
+	unsigned long active;
+	struct zone *zone;
+	u32 hash, cookie;
+	bool file;
+
+	if (!shadow_table)
+		return false;
+
+	hash = shadow_hash(mapping, index);
+	bucket = shadow_bucket(hash);
+
+	for (entry = bucket; entry < bucket + SHADOW_BUCKET_SIZE; entry++) {
+		if (ACCESS_ONCE(entry->tag) != hash)
+			continue;
+		smp_rmb();
+		cookie = ACCESS_ONCE(entry->cookie);
+		/* claim it; if it was replaced meanwhile, treat as a miss */
+		if (cmpxchg(&entry->tag, hash, 0) == hash)
+			break;
+	}
+	if (entry == bucket + SHADOW_BUCKET_SIZE)
+		return false;
+
+	unpack_cookie(cookie, &zone, &eviction, &file);
+	refault = atomic_long_read(&zone->inactive_age);
+	if (file)
+		active = zone_page_state(zone, NR_ACTIVE_FILE);
+	else
+		active = zone_page_state(zone, NR_ACTIVE_ANON);
+
+	/*
+	 * The masked unsigned subtraction copes with inactive_age wrapping
+	 * within the cookie.  An entry old enough to be lapped entirely
+	 * yields a bogus short distance, but the table turns over far
+	 * sooner than that, and one wrong activation is harmless.
+	 */
+	refault_distance = (refault - eviction) &
+		((unsigned long)EVICTION_MASK << bucket_order);
+
+	inc_zone_state(zone, WORKINGSET_REFAULT);
+
+	if (refault_distance <= active) {
+		inc_zone_state(zone, WORKINGSET_ACTIVATE);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * workingset_activation - note a page activation
+ * @page: page that is being activated
+ */
+void workingset_activation(struct page *page)
+{
+	atomic_long_inc(&page_zone(page)->inactive_age);
+}
+
+static int __init workingset_init(void)
+{
+	unsigned int timestamp_bits;
+	unsigned int max_order;
+	unsigned long nr_buckets;
+
+	timestamp_bits = 32 - EVICTION_SHIFT;
+	max_order = fls_long(totalram_pages - 1);
+	if (max_order > timestamp_bits)
+		bucket_order = max_order - timestamp_bits;
+
+	/* remember about half as many evictions as there are pages */
+	nr_buckets = totalram_pages / 2 / SHADOW_BUCKET_SIZE;
+	if (nr_buckets < 1)
+		nr_buckets = 1;
+	nr_buckets = rounddown_pow_of_two(nr_buckets);
+
+	shadow_table = vzalloc(nr_buckets * SHADOW_BUCKET_SIZE *
+			       sizeof(struct shadow_entry));
+	if (!shadow_table) {
+		printk(KERN_WARNING "workingset: failed to allocate %lu "
+		       "shadow buckets, refault detection disabled\n",
+		       nr_buckets);
+		return -ENOMEM;
+	}
+	shadow_bucket_mask = nr_buckets - 1;
+
+	printk(KERN_INFO "workingset: timestamp_bits=%d max_order=%d "
+	       "bucket_order=%u shadow_entries=%lu\n", timestamp_bits,
+	       max_order, bucket_order, nr_buckets * SHADOW_BUCKET_SIZE);
+	return 0;
+}
+module_init(workingset_init);
@@ -0,0 +1,279 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -I../../drivers/staging/android -o ashmem-stress ashmem-stress.c -lpthread */
+
+/*
+ * Concurrent ashmem pin/unpin against the purge shrinker.
+ *
+ * Each worker thread owns an ashmem area split into ranges, about half
+ * of which are unpinned at any time.  It keeps picking a random range
+ * and flipping it: pinning an unpinned range, or unpinning a pinned
+ * one.  Meanwhile a purger thread issues ASHMEM_PURGE_ALL_CACHES in a
+ * loop, which runs the shrinker over every unpinned range.
+ *
+ * Every page carries a pattern.  A range that ASHMEM_PIN reports as not
+ * purged must still hold it, which catches a purge racing with pin.
+ * Throughput and the worst pin/unpin latency show how much workers
+ * stall behind each other and behind the shrinker.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "ashmem.h"
+
+#define ASHMEM_DEV	"/dev/ashmem"
+#define PAGE_SZ		4096
+
+static int nr_workers = 4;
+static int nr_ranges = 256;
+static int range_pages = 4;
+static int duration = 10;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int id;
+	long ops;
+	long purged;
+	long corrupt;
+	double max_latency;
+	int err;
+};
+
+static long nr_purges;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long pattern(int id, int range, int page)
+{
+	return ((unsigned long)id << 40) | ((unsigned long)range << 16) |
+		page | 1;
+}
+
+static void fill_range(char *base, int id, int range)
+{
+	int i;
+
+	for (i = 0; i < range_pages; i++) {
+		char *page = base + ((size_t)range * range_pages + i) * PAGE_SZ;
+		unsigned long val = pattern(id, range, i);
+
+		memcpy(page, &val, sizeof(val));
+	}
+}
+
+static int check_range(char *base, int id, int range)
+{
+	int i;
+
+	for (i = 0; i < range_pages; i++) {
+		char *page = base + ((size_t)range * range_pages + i) * PAGE_SZ;
+		unsigned long val;
+
+		memcpy(&val, page, sizeof(val));
+		if (val != pattern(id, range, i))
+			return -1;
+	}
+	return 0;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	size_t size = (size_t)nr_ranges * range_pages * PAGE_SZ;
+	unsigned int seed = w->id + 1;
+	struct ashmem_pin pin;
+	char name[32], *base;
+	char *unpinned;
+	double t, latency;
+	int fd, range, ret;
+
+	unpinned = calloc(nr_ranges, 1);
+	fd = open(ASHMEM_DEV, O_RDWR);
+	if (!unpinned || fd < 0) {
+		w->err = errno ? errno : ENOMEM;
+		return NULL;
+	}
+	snprintf(name, sizeof(name), "ashmem-stress-%d", w->id);
+	if (ioctl(fd, ASHMEM_SET_NAME, name) < 0 ||
+	    ioctl(fd, ASHMEM_SET_SIZE, size) < 0) {
+		w->err = errno;
+		goto out;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		w->err = errno;
+		goto out;
+	}
+	for (range = 0; range < nr_ranges; range++)
+		fill_range(base, w->id, range);
+
+	while (!stop) {
+		range = rand_r(&seed) % nr_ranges;
+		pin.offset = range * range_pages * PAGE_SZ;
+		pin.len = range_pages * PAGE_SZ;
+
+		t = now();
+		ret = ioctl(fd, unpinned[range] ? ASHMEM_PIN : ASHMEM_UNPIN,
+			    &pin);
+		latency = now() - t;
+		if (ret < 0) {
+			w->err = errno;
+			break;
+		}
+		if (latency > w->max_latency)
+			w->max_latency = latency;
+		w->ops++;
+
+		if (unpinned[range]) {
+			if (ret == ASHMEM_WAS_PURGED) {
+				w->purged++;
+				fill_range(base, w->id, range);
+			} else if (check_range(base, w->id, range)) {
+				w->corrupt++;
+				fill_range(base, w->id, range);
+			}
+		}
+		unpinned[range] = !unpinned[range];
+	}
+	munmap(base, size);
+out:
+	close(fd);
+	free(unpinned);
+	return NULL;
+}
+
+static void *purger_fn(void *arg)
+{
+	int fd;
+
+	(void)arg;
+	fd = open(ASHMEM_DEV, O_RDWR);
+	if (fd < 0)
+		return NULL;
+	while (!stop) {
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0) {
+			perror("ASHMEM_PURGE_ALL_CACHES");
+			break;
+		}
+		nr_purges++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-w workers] [-r ranges] [-p pages] [-t seconds]\n"
+		"  -w  pin/unpin threads, one area each (default 4)\n"
+		"  -r  ranges per area (default 256)\n"
+		"  -p  pages per range (default 4)\n"
+		"  -t  run time in seconds (default 10)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	pthread_t purger;
+	long ops = 0, purged = 0, corrupt = 0;
+	double max_latency = 0, start, elapsed;
+	int i, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "w:r:p:t:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nr_workers = atoi(optarg);
+			break;
+		case 'r':
+			nr_ranges = atoi(optarg);
+			break;
+		case 'p':
+			range_pages = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nr_workers < 1 || nr_ranges < 1 ||
+	    range_pages < 1 || duration < 1)
+		usage(argv[0]);
+
+	if (access(ASHMEM_DEV, R_OK | W_OK)) {
+		perror(ASHMEM_DEV);
+		return 1;
+	}
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	start = now();
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn,
+				   &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	if (pthread_create(&purger, NULL, purger_fn, NULL)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	pthread_join(purger, NULL);
+	elapsed = now() - start;
+
+	for (i = 0; i < nr_workers; i++) {
+		struct worker *w = &workers[i];
+
+		if (w->err) {
+			fprintf(stderr, "worker %d: %s\n", i, strerror(w->err));
+			ret = 1;
+		}
+		ops += w->ops;
+		purged += w->purged;
+		corrupt += w->corrupt;
+		if (w->max_latency > max_latency)
+			max_latency = w->max_latency;
+	}
+
+	printf("workers %3d  pin/unpin %10.0f/s  max latency %8.1f us  "
+	       "purge calls %ld  purged ranges %ld\n", nr_workers,
+	       ops / elapsed, max_latency * 1e6, nr_purges, purged);
+	if (corrupt) {
+		printf("%ld ranges lost their contents without being "
+		       "reported purged\n", corrupt);
+		ret = 1;
+	}
+	return ret;
+}
@@ -0,0 +1,351 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -I../../drivers/staging/android -o binder-bench binder-bench.c -lpthread */
+
+/*
+ * Binder transaction throughput with many concurrent client processes.
+ *
+ * One server process becomes the context manager and runs a looper
+ * thread per client.  Every client process sends synchronous
+ * transactions to handle 0 and waits for each reply.  With a driver
+ * that serialises on one lock, the total rate stops growing with the
+ * number of clients at about one CPU's worth; with per-object locking
+ * it should keep scaling up to the number of CPUs.
+ *
+ * The server needs the context manager slot, so stop servicemanager
+ * (or run on a system without it) before using this.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	(1024 * 1024)
+#define MAX_PAYLOAD	4096
+
+static int nr_clients = 4;
+static int iterations = 100000;
+static int payload = 64;
+static char payload_buf[MAX_PAYLOAD];
+
+struct client_result {
+	double elapsed;
+	double max_latency;
+	int done;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int binder_open(void)
+{
+	struct binder_version vers;
+	int fd;
+
+	fd = open(BINDER_DEV, O_RDWR);
+	if (fd < 0) {
+		perror(BINDER_DEV);
+		return -1;
+	}
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder: protocol version mismatch\n");
+		close(fd);
+		return -1;
+	}
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int binder_write_read(int fd, void *wbuf, size_t wlen,
+			     void *rbuf, size_t rlen, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wlen;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rlen;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (bwr.write_consumed != (signed long)wlen)
+		return -EIO;
+	*consumed = bwr.read_consumed;
+	return 0;
+}
+
+/* append a command and its argument to a write buffer */
+static size_t put_cmd(char *buf, size_t len, uint32_t cmd,
+		      const void *arg, size_t size)
+{
+	memcpy(buf + len, &cmd, sizeof(cmd));
+	memcpy(buf + len + sizeof(cmd), arg, size);
+	return len + sizeof(cmd) + size;
+}
+
+static void *server_looper(void *arg)
+{
+	int fd = (long)arg;
+	char rbuf[1024], wbuf[256];
+	struct binder_transaction_data tr, reply;
+	size_t wlen, consumed, pos;
+	uint32_t cmd;
+	void *buffer;
+
+	wlen = put_cmd(wbuf, 0, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		if (binder_write_read(fd, wbuf, wlen, rbuf, sizeof(rbuf),
+				      &consumed) < 0) {
+			perror("server: BINDER_WRITE_READ");
+			exit(1);
+		}
+		wlen = 0;
+		for (pos = 0; pos + sizeof(cmd) <= consumed;) {
+			memcpy(&cmd, rbuf + pos, sizeof(cmd));
+			pos += sizeof(cmd);
+			if (cmd == BR_TRANSACTION) {
+				memcpy(&tr, rbuf + pos, sizeof(tr));
+				buffer = (void *)tr.data.ptr.buffer;
+				wlen = put_cmd(wbuf, wlen, BC_FREE_BUFFER,
+					       &buffer, sizeof(buffer));
+				memset(&reply, 0, sizeof(reply));
+				reply.data_size = sizeof(uint32_t);
+				reply.data.ptr.buffer = payload_buf;
+				wlen = put_cmd(wbuf, wlen, BC_REPLY,
+					       &reply, sizeof(reply));
+			}
+			pos += _IOC_SIZE(cmd);
+		}
+	}
+	return NULL;
+}
+
+static void run_server(int ready_fd)
+{
+	pthread_t thread;
+	int fd, i, max_threads = 0;
+
+	fd = binder_open();
+	if (fd < 0)
+		exit(1);
+	if (ioctl(fd, BINDER_SET_MAX_THREADS, &max_threads) < 0 ||
+	    ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+		exit(1);
+	}
+	for (i = 0; i < nr_clients; i++) {
+		if (pthread_create(&thread, NULL, server_looper,
+				   (void *)(long)fd)) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	if (write(ready_fd, "", 1) != 1)
+		exit(1);
+	for (;;)
+		pause();
+}
+
+static void run_client(int go_fd, int result_fd)
+{
+	struct binder_transaction_data tr;
+	struct client_result res;
+	char rbuf[512], wbuf[256];
+	size_t wlen, consumed, pos;
+	void *reply_buffer = NULL;
+	double start, t, latency;
+	uint32_t cmd;
+	int fd, i, got_reply;
+	char c;
+
+	memset(&res, 0, sizeof(res));
+	fd = binder_open();
+	if (fd < 0)
+		exit(1);
+	if (read(go_fd, &c, 1) != 1)
+		exit(1);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		wlen = 0;
+		if (reply_buffer)
+			wlen = put_cmd(wbuf, wlen, BC_FREE_BUFFER,
+				       &reply_buffer, sizeof(reply_buffer));
+		reply_buffer = NULL;
+		memset(&tr, 0, sizeof(tr));
+		tr.target.handle = 0;
+		tr.code = 1;
+		tr.data_size = payload;
+		tr.data.ptr.buffer = payload_buf;
+		wlen = put_cmd(wbuf, wlen, BC_TRANSACTION, &tr, sizeof(tr));
+
+		t = now();
+		got_reply = 0;
+		while (!got_reply) {
+			if (binder_write_read(fd, wbuf, wlen, rbuf,
+					      sizeof(rbuf), &consumed) < 0) {
+				perror("client: BINDER_WRITE_READ");
+				goto out;
+			}
+			wlen = 0;
+			for (pos = 0; pos + sizeof(cmd) <= consumed;) {
+				memcpy(&cmd, rbuf + pos, sizeof(cmd));
+				pos += sizeof(cmd);
+				if (cmd == BR_REPLY) {
+					memcpy(&tr, rbuf + pos, sizeof(tr));
+					reply_buffer = (void *)tr.data.ptr.buffer;
+					got_reply = 1;
+				} else if (cmd == BR_DEAD_REPLY ||
+					   cmd == BR_FAILED_REPLY) {
+					fprintf(stderr, "client: transaction failed\n");
+					goto out;
+				}
+				pos += _IOC_SIZE(cmd);
+			}
+		}
+		latency = now() - t;
+		if (latency > res.max_latency)
+			res.max_latency = latency;
+		res.done++;
+	}
+out:
+	res.elapsed = now() - start;
+	if (write(result_fd, &res, sizeof(res)) != sizeof(res))
+		exit(1);
+	exit(res.done == iterations ? 0 : 1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-c clients] [-i iterations] [-s payload]\n"
+		"  -c  number of client processes (default 4)\n"
+		"  -i  transactions per client (default 100000)\n"
+		"  -s  transaction payload in bytes (default 64, max %d)\n",
+		prog, MAX_PAYLOAD);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int ready_pipe[2], go_pipe[2], result_pipe[2];
+	struct client_result res;
+	double max_elapsed = 0, max_latency = 0;
+	long total = 0;
+	pid_t server;
+	int i, opt, status, ret = 0;
+	char c;
+
+	while ((opt = getopt(argc, argv, "c:i:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_clients = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nr_clients < 1 || iterations < 1 ||
+	    payload < 0 || payload > MAX_PAYLOAD)
+		usage(argv[0]);
+
+	if (pipe(ready_pipe) || pipe(go_pipe) || pipe(result_pipe)) {
+		perror("pipe");
+		return 1;
+	}
+
+	server = fork();
+	if (server < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (!server)
+		run_server(ready_pipe[1]);
+	close(ready_pipe[1]);
+	if (read(ready_pipe[0], &c, 1) != 1) {
+		waitpid(server, NULL, 0);
+		return 1;
+	}
+
+	for (i = 0; i < nr_clients; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			kill(server, SIGKILL);
+			return 1;
+		}
+		if (!pid)
+			run_client(go_pipe[0], result_pipe[1]);
+	}
+	close(result_pipe[1]);
+	close(go_pipe[0]);
+
+	/* let every client start at once */
+	for (i = 0; i < nr_clients; i++)
+		if (write(go_pipe[1], "", 1) != 1)
+			return 1;
+
+	for (i = 0; i < nr_clients; i++) {
+		if (read(result_pipe[0], &res, sizeof(res)) != sizeof(res)) {
+			ret = 1;
+			break;
+		}
+		total += res.done;
+		if (res.elapsed > max_elapsed)
+			max_elapsed = res.elapsed;
+		if (res.max_latency > max_latency)
+			max_latency = res.max_latency;
+	}
+	for (i = 0; i < nr_clients; i++) {
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+
+	if (max_elapsed > 0)
+		printf("clients %3d  transactions %9ld  %8.3f s  %10.0f/s  "
+		       "max latency %8.1f us\n", nr_clients, total,
+		       max_elapsed, total / max_elapsed, max_latency * 1e6);
+	return ret;
+}
@@ -0,0 +1,244 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -o lmk-bench lmk-bench.c */
+
+/*
+ * Cost of a lowmemorykiller shrinker call with many processes around.
+ *
+ * Forks a number of sleeping processes with oom_score_adj spread over
+ * 0..LMK_ADJ-1, then sets the lowmemorykiller thresholds so that every
+ * call finds memory "low" and looks for a victim at LMK_ADJ or above.
+ * None of the children qualifies, so nothing gets killed, and each call
+ * costs whatever it takes to find that out: a walk over every process
+ * with a plain task list scan, next to nothing with the adj index.
+ *
+ * Shrinker calls are driven by dropping slab caches, and timed with the
+ * function_graph tracer on lowmem_shrink.  Needs root, debugfs mounted
+ * on /sys/kernel/debug and CONFIG_FUNCTION_GRAPH_TRACER.
+ *
+ * Any other process at oom_score_adj LMK_ADJ may be killed while this
+ * runs, so use it on a test system.  The original thresholds are put
+ * back on exit.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define LMK_PARAMS	"/sys/module/lowmemorykiller/parameters/"
+#define TRACING		"/sys/kernel/debug/tracing/"
+#define LMK_ADJ		1000
+#define CHILD_PAGES	16
+
+static int nr_procs = 300;
+static int iterations = 20;
+
+static char saved_adj[256], saved_minfree[256];
+static pid_t *children;
+static int nr_children;
+
+static int write_file(const char *path, const char *val)
+{
+	int fd, len = strlen(val), ret = 0;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, val, len) != len)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	int fd;
+	ssize_t len;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+	return 0;
+}
+
+static void cleanup(void)
+{
+	int i;
+
+	write_file(TRACING "tracing_on", "0");
+	write_file(TRACING "current_tracer", "nop");
+	write_file(TRACING "set_ftrace_filter", "");
+	if (saved_adj[0])
+		write_file(LMK_PARAMS "adj", saved_adj);
+	if (saved_minfree[0])
+		write_file(LMK_PARAMS "minfree", saved_minfree);
+	for (i = 0; i < nr_children; i++)
+		kill(children[i], SIGKILL);
+	while (wait(NULL) > 0)
+		;
+}
+
+static void sig_handler(int sig)
+{
+	(void)sig;
+	exit(1);
+}
+
+static void child(int adj)
+{
+	char buf[16], *mem;
+	int i;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	snprintf(buf, sizeof(buf), "%d", adj);
+	if (write_file("/proc/self/oom_score_adj", buf))
+		_exit(1);
+	/* give the child something to weigh */
+	mem = malloc(CHILD_PAGES * 4096);
+	if (mem)
+		for (i = 0; i < CHILD_PAGES; i++)
+			mem[i * 4096] = 1;
+	for (;;)
+		pause();
+}
+
+/* sum up the lowmem_shrink durations in the function_graph trace */
+static void report(void)
+{
+	double us, total = 0, max = 0;
+	long calls = 0;
+	char line[512], *p;
+	FILE *f;
+
+	f = fopen(TRACING "trace", "r");
+	if (!f) {
+		perror(TRACING "trace");
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || !strstr(line, "lowmem_shrink"))
+			continue;
+		p = strstr(line, " us ");
+		if (!p)
+			continue;
+		/* walk back to the start of the duration */
+		while (p > line && p[-1] != ' ' && p[-1] != '+' && p[-1] != '!')
+			p--;
+		us = strtod(p, NULL);
+		total += us;
+		if (us > max)
+			max = us;
+		calls++;
+	}
+	fclose(f);
+
+	if (!calls) {
+		printf("no lowmem_shrink calls traced\n");
+		return;
+	}
+	printf("processes %5d  calls %7ld  avg %9.2f us  max %9.2f us  "
+	       "total %10.0f us\n", nr_procs, calls, total / calls, max, total);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n processes] [-i iterations]\n"
+		"  -n  number of processes to fork (default 300)\n"
+		"  -i  times the slab caches are dropped (default 20)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char buf[64];
+	int i, opt, err;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_procs = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nr_procs < 0 || iterations < 1)
+		usage(argv[0]);
+
+	children = calloc(nr_procs, sizeof(*children));
+	if (!children && nr_procs)
+		return 1;
+
+	if (read_file(LMK_PARAMS "adj", saved_adj, sizeof(saved_adj)) ||
+	    read_file(LMK_PARAMS "minfree", saved_minfree,
+		      sizeof(saved_minfree))) {
+		fprintf(stderr, "lowmemorykiller parameters not found\n");
+		return 1;
+	}
+	atexit(cleanup);
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	for (i = 0; i < nr_procs; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (!pid)
+			child(i * LMK_ADJ / nr_procs);
+		children[nr_children++] = pid;
+	}
+
+	/* memory is always low, but only LMK_ADJ and above may be killed */
+	snprintf(buf, sizeof(buf), "%d", LMK_ADJ);
+	err = write_file(LMK_PARAMS "adj", buf);
+	if (!err)
+		err = write_file(LMK_PARAMS "minfree", "1073741824");
+	if (err) {
+		fprintf(stderr, "setting lowmemorykiller parameters: %s\n",
+			strerror(-err));
+		return 1;
+	}
+
+	if (write_file(TRACING "tracing_on", "0") ||
+	    write_file(TRACING "set_ftrace_filter", "lowmem_shrink") ||
+	    write_file(TRACING "current_tracer", "function_graph") ||
+	    write_file(TRACING "trace", "")) {
+		fprintf(stderr, "function_graph tracer not available\n");
+		return 1;
+	}
+	write_file(TRACING "tracing_on", "1");
+	for (i = 0; i < iterations; i++) {
+		if (write_file("/proc/sys/vm/drop_caches", "2")) {
+			perror("/proc/sys/vm/drop_caches");
+			return 1;
+		}
+	}
+	write_file(TRACING "tracing_on", "0");
+
+	report();
+	return 0;
+}
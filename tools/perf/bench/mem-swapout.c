@@ -0,0 +1,205 @@
+/*
+ * mem-swapout.c
+ *
+ * swapout: swap-out throughput of several threads dirtying anonymous memory
+ *
+ * Each thread keeps writing to its own anonymous mapping, and together
+ * they use more memory than fits in RAM, so that reclaim on every CPU
+ * pushes pages to swap at once.  How pswpout per second grows with the
+ * number of threads shows how well swap slot allocation scales; it is
+ * best run with a fast swap device such as zram.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define K 1024
+
+static const char	*length_str	= "";
+static int		nr_threads;
+static int		passes		= 2;
+
+static const struct option options[] = {
+	OPT_STRING('l', "length", &length_str, "1.5 x RAM",
+		    "Specify amount of memory to dirty in total. "
+		    "available unit: B, MB, GB (upper and lower)"),
+	OPT_INTEGER('t', "threads", &nr_threads,
+		    "Specify number of threads (default: online CPUs)"),
+	OPT_INTEGER('p', "passes", &passes,
+		    "Specify number of passes over each thread's memory"),
+	OPT_END()
+};
+
+static const char * const bench_mem_swapout_usage[] = {
+	"perf bench mem swapout <options>",
+	NULL
+};
+
+struct swapout_thread {
+	pthread_t	thread;
+	unsigned long	id;
+	size_t		len;
+	char		*mem;
+};
+
+static pthread_barrier_t start_barrier;
+static long page_size;
+
+static u64 read_pswpout(void)
+{
+	char line[128];
+	u64 val = 0;
+	FILE *f;
+
+	f = fopen("/proc/vmstat", "r");
+	if (!f)
+		die("cannot open /proc/vmstat\n");
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "pswpout %" PRIu64, &val) == 1)
+			break;
+	}
+	fclose(f);
+	return val;
+}
+
+static void *swapout_worker(void *arg)
+{
+	struct swapout_thread *t = arg;
+	unsigned long n = 0;
+	size_t off;
+	int i;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < passes; i++) {
+		/* a unique word per page keeps zram from sharing pages */
+		for (off = 0; off < t->len; off += page_size, n++) {
+			unsigned long *word = (unsigned long *)(t->mem + off);
+
+			word[0] = n;
+			word[1] = t->id;
+		}
+	}
+	return NULL;
+}
+
+static double timeval2double(struct timeval *ts)
+{
+	return (double)ts->tv_sec +
+		(double)ts->tv_usec / (double)1000000;
+}
+
+int bench_mem_swapout(int argc, const char **argv,
+		      const char *prefix __used)
+{
+	struct swapout_thread *threads;
+	struct timeval tv_start, tv_end, tv_diff;
+	u64 pswpout_start, pswpout_end;
+	double secs, swapped;
+	size_t len, per_thread;
+	int i;
+
+	argc = parse_options(argc, argv, options,
+			     bench_mem_swapout_usage, 0);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (!nr_threads)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 1 || passes < 1) {
+		fprintf(stderr, "Invalid threads:%d or passes:%d\n",
+			nr_threads, passes);
+		return 1;
+	}
+
+	if (*length_str) {
+		len = (size_t)perf_atoll((char *)length_str);
+		if ((s64)len <= 0) {
+			fprintf(stderr, "Invalid length:%s\n", length_str);
+			return 1;
+		}
+	} else {
+		len = (size_t)sysconf(_SC_PHYS_PAGES) * page_size;
+		len += len / 2;
+	}
+
+	per_thread = len / nr_threads / page_size * page_size;
+	if (!per_thread) {
+		fprintf(stderr, "Length too small for %d threads\n",
+			nr_threads);
+		return 1;
+	}
+
+	threads = zalloc(nr_threads * sizeof(*threads));
+	if (!threads)
+		die("memory allocation failed\n");
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].id = i;
+		threads[i].len = per_thread;
+		threads[i].mem = mmap(NULL, per_thread, PROT_READ | PROT_WRITE,
+				      MAP_PRIVATE | MAP_ANONYMOUS |
+				      MAP_NORESERVE, -1, 0);
+		if (threads[i].mem == MAP_FAILED)
+			die("mmap failed: %s\n", strerror(errno));
+	}
+
+	BUG_ON(pthread_barrier_init(&start_barrier, NULL, nr_threads + 1));
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, swapout_worker,
+				   &threads[i]))
+			die("pthread_create failed\n");
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# Dirtying %zu MB in %d threads, %d passes ...\n\n",
+		       per_thread * nr_threads / K / K, nr_threads, passes);
+
+	pswpout_start = read_pswpout();
+	BUG_ON(gettimeofday(&tv_start, NULL));
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	BUG_ON(gettimeofday(&tv_end, NULL));
+	pswpout_end = read_pswpout();
+
+	timersub(&tv_end, &tv_start, &tv_diff);
+	secs = timeval2double(&tv_diff);
+	swapped = (double)(pswpout_end - pswpout_start) * page_size / K / K;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       tv_diff.tv_sec,
+		       (unsigned long) (tv_diff.tv_usec / 1000));
+		printf(" %14" PRIu64 " pages swapped out\n",
+		       pswpout_end - pswpout_start);
+		printf(" %14lf MB/Sec swapped out\n", swapped / secs);
+		if (pswpout_end == pswpout_start)
+			printf("\n # Nothing was swapped out, "
+			       "is swap enabled?\n");
+		break;
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lf\n", swapped / secs);
+		break;
+	default:
+		/* reaching this means there's some disaster: */
+		die("unknown format: %d\n", bench_format);
+		break;
+	}
+
+	pthread_barrier_destroy(&start_barrier);
+	for (i = 0; i < nr_threads; i++)
+		munmap(threads[i].mem, per_thread);
+	free(threads);
+	return 0;
+}
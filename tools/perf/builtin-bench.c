@@ -52,6 +52,9 @@ static struct bench_suite mem_suites[] = {
 	{ "memcpy",
 	  "Simple memory copy in various ways",
 	  bench_mem_memcpy },
+	{ "swapout",
+	  "Swap-out throughput of threads dirtying anonymous memory",
+	  bench_mem_swapout },
 	suite_all,
 	{ NULL,
 	  NULL,
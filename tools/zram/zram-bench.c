@@ -0,0 +1,197 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -g -o zram-bench zram-bench.c -lpthread */
+
+/*
+ * zram write throughput versus number of writer threads.
+ *
+ * Every thread writes its own slice of the device in page-sized direct
+ * I/O, so that each write is compressed right away on the writer's CPU,
+ * the way swap-out from several reclaiming tasks hits the device.  Page
+ * contents are partly random, to give the requested compressibility,
+ * and partly unique, to keep same-page and dedup handling out of it.
+ *
+ * Run it once per compression stream mode, see zram-bench.sh.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#define PAGE_SZ		4096
+#define NR_BUFS		64
+
+static const char *device;
+static int nr_threads = 1;
+static int compress_pct = 50;
+static int loops = 4;
+static unsigned long long slice_bytes;
+static pthread_barrier_t start_barrier;
+
+struct writer {
+	pthread_t thread;
+	int id;
+	int err;
+};
+
+/* random for the incompressible part, zeroes for the rest */
+static void fill_page(char *buf, unsigned int seed)
+{
+	int random_bytes = PAGE_SZ * (100 - compress_pct) / 100;
+	int i;
+
+	for (i = 0; i < random_bytes; i++)
+		buf[i] = rand_r(&seed);
+	memset(buf + random_bytes, 0, PAGE_SZ - random_bytes);
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	unsigned long long off, start = w->id * slice_bytes;
+	unsigned long long n = 0;
+	char *bufs;
+	int fd, i;
+
+	fd = open(device, O_WRONLY | O_DIRECT);
+	if (fd < 0) {
+		w->err = errno;
+		pthread_barrier_wait(&start_barrier);
+		return NULL;
+	}
+	if (posix_memalign((void **)&bufs, PAGE_SZ, NR_BUFS * PAGE_SZ)) {
+		w->err = ENOMEM;
+		close(fd);
+		pthread_barrier_wait(&start_barrier);
+		return NULL;
+	}
+	for (i = 0; i < NR_BUFS; i++)
+		fill_page(bufs + i * PAGE_SZ, w->id * NR_BUFS + i + 1);
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < loops; i++) {
+		for (off = 0; off < slice_bytes; off += PAGE_SZ, n++) {
+			char *buf = bufs + (n % NR_BUFS) * PAGE_SZ;
+
+			/* a unique tag defeats deduplication */
+			memcpy(buf, &n, sizeof(n));
+			memcpy(buf + sizeof(n), &w->id, sizeof(w->id));
+			if (pwrite(fd, buf, PAGE_SZ, start + off) != PAGE_SZ) {
+				w->err = errno;
+				goto out;
+			}
+		}
+	}
+out:
+	free(bufs);
+	close(fd);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t threads] [-c compressible%%] [-l loops] device\n"
+		"  -t  number of writer threads (default 1)\n"
+		"  -c  compressible part of each page in percent (default 50)\n"
+		"  -l  times each thread rewrites its slice (default 4)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long dev_bytes;
+	struct writer *writers;
+	double start, elapsed;
+	int fd, i, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "t:c:l:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'c':
+			compress_pct = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nr_threads < 1 ||
+	    compress_pct < 0 || compress_pct > 100 || loops < 1)
+		usage(argv[0]);
+	device = argv[optind];
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &dev_bytes) < 0) {
+		perror(device);
+		return 1;
+	}
+	close(fd);
+
+	slice_bytes = dev_bytes / nr_threads / PAGE_SZ * PAGE_SZ;
+	if (!slice_bytes) {
+		fprintf(stderr, "%s: too small for %d threads\n",
+			device, nr_threads);
+		return 1;
+	}
+
+	writers = calloc(nr_threads, sizeof(*writers));
+	if (!writers)
+		return 1;
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i++) {
+		writers[i].id = i;
+		if (pthread_create(&writers[i].thread, NULL, writer_fn,
+				   &writers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	start = now();
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(writers[i].thread, NULL);
+	elapsed = now() - start;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (writers[i].err) {
+			fprintf(stderr, "writer %d: %s\n", i,
+				strerror(writers[i].err));
+			ret = 1;
+		}
+	}
+
+	printf("threads %3d  written %8.1f MB  %8.3f s  %9.1f MB/s\n",
+	       nr_threads,
+	       (double)slice_bytes * nr_threads * loops / (1 << 20), elapsed,
+	       (double)slice_bytes * nr_threads * loops / (1 << 20) / elapsed);
+	return ret;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Compare zram write throughput of the shared (max_comp_streams) and the
+# per-CPU (percpu_comp_streams) compression stream modes, for thread
+# counts from 1 up to twice the number of online CPUs.
+#
+# usage: zram-bench.sh [device] [disksize] [compressible%]
+#
+# The device is reset and reconfigured for every mode, so do not point
+# it at a zram device that is in use as swap.
+#
+
+DEV=${1:-zram0}
+SIZE=${2:-512M}
+COMP=${3:-50}
+SYS=/sys/block/$DEV
+BENCH=$(dirname $0)/zram-bench
+
+CPUS=$(getconf _NPROCESSORS_ONLN)
+
+if [ ! -d $SYS ]; then
+	echo "$SYS not found, is the zram module loaded?" >&2
+	exit 1
+fi
+if [ ! -x $BENCH ]; then
+	echo "$BENCH not found, run make first" >&2
+	exit 1
+fi
+
+setup() {
+	echo 1 > $SYS/reset || exit 1
+	echo $CPUS > $SYS/max_comp_streams
+	echo $1 > $SYS/percpu_comp_streams || exit 1
+	echo $SIZE > $SYS/disksize || exit 1
+}
+
+for mode in 0 1; do
+	if [ $mode = 0 ]; then
+		echo "== $CPUS shared compression streams"
+	else
+		echo "== per-CPU compression streams"
+	fi
+	threads=1
+	while [ $threads -le $((CPUS * 2)) ]; do
+		setup $mode
+		$BENCH -t $threads -c $COMP /dev/$DEV || exit 1
+		echo "            writestall $(cat $SYS/writestall)"
+		threads=$((threads * 2))
+	done
+done
+
+echo 1 > $SYS/reset